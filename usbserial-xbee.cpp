@@ -10,6 +10,7 @@
 // include
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <termios.h>
 #include <unistd.h>
@@ -20,9 +21,28 @@
 #include <time.h>       // For measuring processing time
 #include <sys/time.h>   // For measuring processing time
 #include <random>       // For generating random number
+#include <atomic>
 #include <vector>
 #include <signal.h>
 #include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include <linux/serial.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <string>
+#include <stdarg.h>
+#include "xbee_codec.h"      // wire format, payload packers, frame encoder and decoder
+#include "xbee_transport.h"  // serial port open, write and read
+#include "xbee_shm.h"        // shared-memory command rings from a ROS node
 
 /* References
  makefile:
@@ -45,18 +65,56 @@
 
 
 // define or declare constants
-const uint8_t HEAD_BYTE  =0x7D;
-const uint8_t ESCAPE_BYTE=0x7E;
-const uint8_t ESCAPE_MASK=0x20;
 #define SERIAL_PORT "/dev/ttyS16" // SDevice file corrensponding to serial interface
 #define HZ 120                    // Communication frequency
+#define BAUD_RATE 115200          // 9600-921600, must match BD of the XBee
+#define OUTQ_LIMIT_CYCLES 1       // skip a cycle while the tty output queue holds more than this many cycles of bytes
+#define OUTQ_FLUSH_CYCLES 8       // discard the queue when it holds more than this many cycles, 0 never discards
+#define LATENCY_TIMER_MS 1        // FTDI USB latency timer, 0 leaves the driver default (16ms)
 #define LOOP_LENGTH 100           // loop length
 #define DATA_SIZE 10              // unit : Bytes
-#define MAX_DATA_TYPE 3
+#define MAX_LINKS 8                 // Maximum number of serial ports (one XBee per robot)
+#define OVERRUN_POLICY OVERRUN_SKIP  // What to do when a cycle misses its deadline
+#define HISTOGRAM_DUMP_INTERVAL 0    // unit : seconds, 0 dumps only at exit
+#define SEND_ONLY_CHANGED false      // true sends a datatype only when it changed or its keep-alive expired
+#define KEEPALIVE_MS_VECTOR 0        // unit : ms, 0 sends every cycle, -1 sends only on change
+#define KEEPALIVE_MS_CALIB 500
+#define KEEPALIVE_MS_KICKER 100
+#define RATE_HZ_VECTOR 0             // send rate of each datatype, 0 sends every cycle
+#define RATE_HZ_CALIB 0
+#define RATE_HZ_KICKER 0
+#define VECTOR_DELTA false           // true sends datatype 0 as small deltas (datatype 4/5) between keyframes
+#define MULTI_RECORD false           // true packs all datatypes of a cycle into one frame (datatype 6)
+#define RELIABLE_DELIVERY false      // true sends calib/kicker once per change with sequence number until the robot ACKs
+#define RELIABLE_WINDOW 4            // unACKed records per datatype in RELIABLE_DELIVERY
+#define KICK_QUEUE_SIZE 16           // kicker commands waiting for the reliable window, power of two
+#define RETRANSMIT_MS 20             // unit : ms, retransmit timeout of an unACKed record
+#define MAX_TRANSMISSIONS 5          // a record is given up after this many transmissions
+#define DELTA_KEYFRAME_MS 100        // unit : ms, full vector at least this often in VECTOR_DELTA
+#define XBEE_API_MODE false          // true talks to one coordinator XBee in API mode (AP=2)
+#define XBEE_BROADCAST false         // API mode: true packs every robot into broadcast TX Requests
+#define XBEE_MAX_RF_DATA 84          // unit : Bytes, RF payload limit of one TX Request
+#define PIPELINE_MODE false          // true writes in a separate writer thread while the loop encodes next cycle
+#define ENCODER_CPU -1               // CPU core of event loop/encoder thread, -1 leaves it to the scheduler
+#define WRITER_CPU -1                // CPU core of writer thread in PIPELINE_MODE
+#define WRITER_SCHED_FIFO 0          // SCHED_FIFO priority (1-99) of writer thread with mlockall(), 0 keeps SCHED_OTHER
+#define FRAME_VERSION 1              // 1 legacy 8-bit sum, 2 CRC-16, 0 negotiates with hello frames (starts at 1)
+#define HELLO_INTERVAL_MS 1000       // unit : ms, FRAME_VERSION 0 repeats hello until the robot answers
+#define RANDOM_SEED 0                // Seed of simulated data, 0 seeds from std::random_device
+#define ADAPTIVE_RATE false          // true stretches the period of BACKOFF_MASK datatypes while a link is congested
+#define BACKOFF_MASK 0x6             // datatypes slowed down by ADAPTIVE_RATE (calib, kicker), velocity keeps its rate
+#define QUALITY_WINDOW_MS 500        // unit : ms, link quality is judged once per window
+#define QUALITY_ERROR_PERCENT 5      // congested above this share of broken frames from the robot
+#define QUALITY_ACK_MS 50            // unit : ms, congested above this average ACK latency
+#define QUALITY_RSSI_DBM -85         // unit : dBm, congested below this RSSI (API mode)
+#define METRICS_PORT 0               // TCP port of the Prometheus /metrics endpoint, 0 off
 
 #define SIMULATE_WITHOUT_ROS
 
-#define ENABLE_DBG             // Toggle when using printf() function
+//#define ENABLE_DBG           // Toggle when using printf() function, prints traced frames
+#ifndef NDEBUG
+#define ENABLE_TRACE           // binary trace ring of every frame, compiled out with -DNDEBUG
+#endif
 #ifndef ENABLE_DBG
 #define DBG(...)
 #else
@@ -76,8 +134,33 @@ const uint8_t ESCAPE_MASK=0x20;
 #endif
 
 // declare global variable
-typedef std::vector<uint8_t> vu8;
+
+enum OverrunPolicy
+{
+  OVERRUN_SKIP,       // drop missed cycles and wait for the next deadline on the grid
+  OVERRUN_CATCH_UP    // run missed cycles back-to-back until caught up
+};
+int cycle_hz=HZ;
 int loop_length,loop_count=0;
+int loop_option=0;                // --loop as parsed, loop_length is derived from it
+int overrun_policy=OVERRUN_POLICY;
+int histogram_dump_interval=HISTOGRAM_DUMP_INTERVAL;
+const char *serial_ports[MAX_LINKS]={SERIAL_PORT};
+int num_links=1;
+int baud_rate=BAUD_RATE;
+int latency_timer_ms=LATENCY_TIMER_MS;
+int outq_limit_cycles=OUTQ_LIMIT_CYCLES;
+int outq_flush_cycles=OUTQ_FLUSH_CYCLES;
+int outq_cycle_bytes=0;           // bytes the UART sends in one period, set in main()
+bool pipeline_mode=PIPELINE_MODE;
+int encoder_cpu=ENCODER_CPU;
+int writer_cpu=WRITER_CPU;
+int writer_sched_fifo=WRITER_SCHED_FIFO;
+bool xbee_api_mode=XBEE_API_MODE;
+bool xbee_broadcast=XBEE_BROADCAST;
+int frame_version=FRAME_VERSION;      // FrameVersion of every link, 0 negotiates
+const uint64_t XBEE_BROADCAST_ADDRESS=0x000000000000FFFFULL;
+uint64_t robot_address[MAX_LINKS]={XBEE_BROADCAST_ADDRESS};  // API mode: 64-bit address of each robot
 bool loop_count_enable=false;
 volatile sig_atomic_t errorFlag=0;
 
@@ -97,6 +180,55 @@ void signalHandler(int signo)
   }
 }
 
+/*
+ * Random number generator for SIMULATE_WITHOUT_ROS
+ * xoshiro256** seeded by splitmix64. One engine per thread is created on
+ * first use and kept, so a call costs a few ns instead of a random_device
+ * read and a 5KB mt19937 initialization.
+ */
+uint64_t random_seed=RANDOM_SEED;
+
+struct Xoshiro256ss
+{
+  typedef uint64_t result_type;
+  uint64_t s[4];
+
+  explicit Xoshiro256ss(uint64_t seed)
+  {
+    for(int i=0;i<4;i++)
+    {
+    // splitmix64
+      seed+=0x9E3779B97F4A7C15ULL;
+      uint64_t z=seed;
+      z=(z^(z>>30))*0xBF58476D1CE4E5B9ULL;
+      z=(z^(z>>27))*0x94D049BB133111EBULL;
+      s[i]=z^(z>>31);
+    }
+  }
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return UINT64_MAX; }
+  static inline uint64_t rotl(uint64_t x,int k) { return (x<<k)|(x>>(64-k)); }
+  result_type operator()()
+  {
+    const uint64_t result=rotl(s[1]*5,7)*9;
+    const uint64_t t=s[1]<<17;
+    s[2]^=s[0];
+    s[3]^=s[1];
+    s[1]^=s[2];
+    s[0]^=s[3];
+    s[2]^=t;
+    s[3]=rotl(s[3],45);
+    return result;
+  }
+};
+
+Xoshiro256ss &getRandomEngine()
+{
+  // RANDOM_SEED 0 means a different sequence on every run
+  thread_local Xoshiro256ss engine(random_seed!=0?random_seed:((uint64_t)std::random_device{}()<<32|std::random_device{}()));
+  return engine;
+}
+
 int createRandomNumber(int min, int max)
 {
   int temp=0;
@@ -112,10 +244,14 @@ int createRandomNumber(int min, int max)
   }
 
   std::uniform_int_distribution<int> dist(min,max);
-  std::mt19937 mt{ std::random_device{}() };
-  return dist(mt);
+  return dist(getRandomEngine());
 }
 
+/* @setParameterFromCommandLine
+ * @brief Apply positional arguments: hz, loop count, then ports or addresses
+ * @detail argv holds what parseOptions() left, so positional arguments
+ *         override the config file and --options. An absent one keeps them.
+ */
 void setParameterFromCommandLine(int argc,char** argv,int *hz,int *loop_len)
 {
   debug("setParameterFromCommandLine begin");
@@ -127,10 +263,6 @@ void setParameterFromCommandLine(int argc,char** argv,int *hz,int *loop_len)
       *hz=HZ;
     }
   }
-  else
-  {
-    *hz=HZ;
-  }
 
   if(argc>=3)
   {
@@ -142,240 +274,4787 @@ void setParameterFromCommandLine(int argc,char** argv,int *hz,int *loop_len)
       loop_count_enable=false;
     }
   }
+  else if(*loop_len>0)
+  {
+    loop_count_enable=true;     // --loop
+  }
   else
   {
     *loop_len=*hz;
       loop_count_enable=false;
   }
-  printf("%d[Hz],loop %d times\n",*hz,*loop_len);
+
+  // API mode: one coordinator port, the rest are 64-bit addresses (hex) of robots
+  if(xbee_api_mode)
+  {
+    if(argc>=4)
+    {
+      serial_ports[0]=argv[3];
+    }
+    for(int i=4;i<argc&&i-4<MAX_LINKS;i++)
+    {
+      robot_address[i-4]=strtoull(argv[i],NULL,16);
+      num_links=i-3;
+    }
+    for(int i=1;i<num_links;i++)
+    {
+      serial_ports[i]=serial_ports[0];
+    }
+  }
+  // the rest are serial ports, one per robot
+  else if(argc>=4)
+  {
+    num_links=0;
+    for(int i=3;i<argc&&num_links<MAX_LINKS;i++)
+    {
+      serial_ports[num_links++]=argv[i];
+    }
+    if(argc-3>MAX_LINKS)
+    {
+      printf("only first %d serial ports are used\n",MAX_LINKS);
+    }
+  }
+  printf("%d[Hz],loop %d times,%d robot(s)\n",*hz,*loop_len,num_links);
 }
 
 
+/* @SeqLock
+ * @brief Latest-value cell shared by one writer thread and any reader thread
+ * @detail store() is wait-free and never blocks the ROS callback. load()
+ *         retries while a store is in progress, so the serial writer always
+ *         gets a value from one store, never a torn mix of two. The value is
+ *         kept in relaxed atomic words, so there is no data race on it.
+ *         Only one thread may call store() on the same SeqLock.
+ */
+template<typename T>
+struct SeqLock
+{
+  static constexpr size_t WORDS=(sizeof(T)+sizeof(uint32_t)-1)/sizeof(uint32_t);
+  std::atomic<uint32_t> seq;
+  std::atomic<uint32_t> words[WORDS];
+
+  SeqLock():seq(0)
+  {
+    for(size_t i=0;i<WORDS;i++)
+    {
+      words[i].store(0,std::memory_order_relaxed);
+    }
+  }
+
+  void store(const T &value)
+  {
+    uint32_t buf[WORDS]={0};
+    uint32_t s=seq.load(std::memory_order_relaxed);
+    memcpy(buf,&value,sizeof(T));
+    seq.store(s+1,std::memory_order_relaxed);         // odd while writing
+    std::atomic_thread_fence(std::memory_order_release);
+    for(size_t i=0;i<WORDS;i++)
+    {
+      words[i].store(buf[i],std::memory_order_relaxed);
+    }
+    seq.store(s+2,std::memory_order_release);
+  }
+
+  T load() const
+  {
+    uint32_t stamp=0;
+    return load(&stamp);
+  }
+
+  // stamp changes with every store(), also when the value is the same
+  T load(uint32_t *stamp) const
+  {
+    uint32_t buf[WORDS];
+    uint32_t s0=0,s1=0;
+    T value;
+    do
+    {
+      s0=seq.load(std::memory_order_acquire);
+      for(size_t i=0;i<WORDS;i++)
+      {
+        buf[i]=words[i].load(std::memory_order_relaxed);
+      }
+      std::atomic_thread_fence(std::memory_order_acquire);
+      s1=seq.load(std::memory_order_relaxed);
+    }while((s0&1)||s0!=s1);
+    memcpy(&value,buf,sizeof(T));
+    *stamp=s0;
+    return value;
+  }
+};
+
 /*
- * data set 0 (datatype=0, velocity vector)
- * | 0-7(8) | 8-10(3) | 11-22(12) | 23-34(12) | 35-46(12) | 47-54(8) |
- * |--------|---------|-----------|-----------|-----------|----------|
- * |HEADER  |DATATYPE |X_VECTOR   |Y_VECTOR   |TH_VECTOR  |CHECKSUM  |
- * |--------|---------|-----------|-----------|-----------|----------|
- *
- * data set 1 (datatype=1, rotation calibration)
- * | 0-7(8) | 8-10(3) | 11-23(13) | 23-30(8) |
- * |--------|---------|-----------|----------|
- * |HEADER  |DATATYPE |CALIB_DATA | CHECKSUM |
- * |--------|---------|-----------|----------|
- *
- * data set 2 (datatype=2, kicker command & robot states)
- * | 0-7(8) | 8-10(3) | 11-15(5)  | 16-23(8) |
- * |--------|---------|-----------|----------|
- * |HEADER  |DATATYPE |COMMAND    |CHECKSUM  |
- * |--------|---------|-----------|----------|
+ * Kick queue
+ * A kicker command is an event, not a setting: with reliable_delivery
+ * each one stored is also pushed here and becomes one record with its own
+ * SEQ, however many arrive within one tick. Single producer (the kicker
+ * callback) and single consumer (the encoder of the link), a full queue
+ * drops the new kick and counts it.
  */
+static_assert((KICK_QUEUE_SIZE&(KICK_QUEUE_SIZE-1))==0,"KICK_QUEUE_SIZE must be a power of two");
+
+struct KickQueue
+{
+  alignas(64) std::atomic<uint32_t> head;   // written by the producer
+  std::atomic<unsigned long> dropped;
+  alignas(64) std::atomic<uint32_t> tail;   // written by the consumer
+  uint16_t command[KICK_QUEUE_SIZE];
+
+  bool full() const
+  {
+    return head.load(std::memory_order_relaxed)-tail.load(std::memory_order_acquire)>=KICK_QUEUE_SIZE;
+  }
+
+  bool push(uint16_t c)
+  {
+    const uint32_t h=head.load(std::memory_order_relaxed);
+    if(h-tail.load(std::memory_order_acquire)>=KICK_QUEUE_SIZE)
+    {
+      dropped.fetch_add(1,std::memory_order_relaxed);
+      return false;
+    }
+    command[h&(KICK_QUEUE_SIZE-1)]=c;
+    head.store(h+1,std::memory_order_release);
+    return true;
+  }
+
+  bool empty() const
+  {
+    return tail.load(std::memory_order_relaxed)==head.load(std::memory_order_acquire);
+  }
+
+  // call only when !empty()
+  uint16_t pop()
+  {
+    const uint32_t t=tail.load(std::memory_order_relaxed);
+    const uint16_t c=command[t&(KICK_QUEUE_SIZE-1)];
+    tail.store(t+1,std::memory_order_release);
+    return c;
+  }
+};
+
+// latest values published for one robot
+struct CommandSource
+{
+  SeqLock<VectorData> vector_data;  // written by vectorCallback
+  SeqLock<uint16_t> calib_data;     // written by visionCallback
+  SeqLock<uint16_t> command;        // written by storeKickerCommand
+  KickQueue kicks;                  // reliable_delivery only
+};
 
 uint8_t datatype=0;
-uint16_t x_vector=0,y_vector=0,th_vector=0,calib_data=0,command=0;
+CommandSource robot_command[MAX_LINKS];  // index is robot number = serial port number
+
+extern bool vector_delta;
+extern bool reliable_delivery;
+
+void vectorCallback(int robot)
+{
+  VectorData v;
+  if(vector_delta)
+  {
+  // random walk, so consecutive commands differ slightly as real ones do
+    v=robot_command[robot].vector_data.load();
+    v.x_vector=(v.x_vector+createRandomNumber(-6,6))&0xFFF;
+    v.y_vector=(v.y_vector+createRandomNumber(-6,6))&0xFFF;
+    v.th_vector=(v.th_vector+createRandomNumber(-6,6))&0xFFF;
+  }
+  else
+  {
+    v.x_vector=createRandomNumber(0,pow(2,12)-1);
+    v.y_vector=createRandomNumber(0,pow(2,12)-1);
+    v.th_vector=createRandomNumber(0,pow(2,12)-1);
+  }
+  robot_command[robot].vector_data.store(v);
+}
+
+void visionCallback(int robot)
+{
+  if(reliable_delivery&&createRandomNumber(0,119)!=0)
+  {
+    return;                       // one-shot commands change rarely
+  }
+  robot_command[robot].calib_data.store(createRandomNumber(0,pow(2,13)-1));
+}
+
+/* @storeKickerCommand
+ * @brief Publish a kicker command of robot, one call is one kick
+ */
+void storeKickerCommand(int robot,uint16_t command)
+{
+  robot_command[robot].command.store(command);
+  if(reliable_delivery)
+  {
+    robot_command[robot].kicks.push(command);
+  }
+}
 
-void vectorCallback()
+void kickerCallback(int robot)
 {
-  x_vector=createRandomNumber(0,pow(2,12)-1);
-  y_vector=createRandomNumber(0,pow(2,12)-1);
-  th_vector=createRandomNumber(0,pow(2,12)-1);
+  if(reliable_delivery&&createRandomNumber(0,29)!=0)
+  {
+    return;
+  }
+  storeKickerCommand(robot,createRandomNumber(0,pow(2,5)-1));
 }
 
-void visionCallback()
+RobotCommand loadRobotCommand(const CommandSource &src)
 {
-  calib_data=createRandomNumber(0,pow(2,13)-1);
+  RobotCommand cmd;
+  cmd.vector=src.vector_data.load();
+  cmd.calib_data=src.calib_data.load();
+  cmd.command=src.command.load();
+  return cmd;
 }
 
-void kickerCallback()
+/* @loadRobotCommand
+ * @param[out] stamp SeqLock stamp of each field, indexed by datatype
+ */
+RobotCommand loadRobotCommand(const CommandSource &src,uint32_t (&stamp)[MAX_DATA_TYPE])
 {
-  command=createRandomNumber(0,pow(2,5)-1);
+  RobotCommand cmd;
+  cmd.vector=src.vector_data.load(&stamp[VectorSchema::datatype]);
+  cmd.calib_data=src.calib_data.load(&stamp[CalibSchema::datatype]);
+  cmd.command=src.command.load(&stamp[KickerSchema::datatype]);
+  return cmd;
 }
 
-/* @setSendDataFromROSBus
- * @brief Split and store sending data in vector container
- * @param[out] buf Vector container. Each data must be split in 1byte(=8bit) data.
- * @detail This function doesn't add header and checksum data.
+/*
+ * Command source
+ * Commands come from the simulation callbacks (SIMULATE_WITHOUT_ROS, the
+ * source of the benchmarks) or, with --shm NAME, from the shared-memory
+ * rings of xbee_shm.h filled by a ROS node, which replaces the TCPROS
+ * subscription. Both end in robot_command[], so the encoder is the same.
  */
+static_assert(MAX_LINKS<=XBEE_SHM_MAX_ROBOTS,"every robot needs a command ring");
+const char *shm_name=NULL;        // --shm, NULL uses the simulation
+ShmCommandArea *shm_area=NULL;
+unsigned long shm_commands[MAX_LINKS];
+int64_t shm_age_max[MAX_LINKS];   // unit : ns, publish to tick
 
-void setSendDataFromROSBus(uint8_t datatype,vu8 *buf){
-  uint8_t tmp=0;
-  switch(datatype)
+/* @pollCommandSource
+ * @brief Bring robot_command[robot] up to date before a tick
+ * @detail Every queued command is applied in order, so the tick sends the
+ *         newest value of each field and, with reliable_delivery, every
+ *         kick. A kick finding the kick queue full stops the drain and
+ *         waits in the ring for the next tick.
+ */
+void pollCommandSource(int robot,int64_t now)
+{
+  ShmCommand c;
+  if(shm_area!=NULL)
   {
-    case 0:
-      tmp=((datatype&0x7)<<5)|(x_vector>>7);
-      buf->push_back(tmp);
-      tmp=((x_vector&0x7F)<<1)|(y_vector>>11);
-      buf->push_back(tmp);
-      tmp=((y_vector>>3)&0xFF);
-      buf->push_back(tmp);
-      tmp=((y_vector&0x3F)<<5)|(th_vector>>8);
-      buf->push_back(tmp);
-      tmp=(th_vector&0xFF);
-      buf->push_back(tmp);
-      break;
-    case 1:
-      tmp=((datatype&0x7)<<5)|(calib_data>>8);
-      buf->push_back(tmp);
-      tmp=(calib_data&0xFF);
-      buf->push_back(tmp);
-      break;
-    case 2:
-      tmp=((datatype&0x7)<<5)|command;
-      buf->push_back(tmp);
-      break;
-    default:
-      break;
+    while(peekShmCommand(shm_area,robot,&c))
+    {
+      if((c.fields&SHM_COMMAND)&&reliable_delivery&&robot_command[robot].kicks.full())
+      {
+        break;
+      }
+      popShmCommand(shm_area,robot,&c);
+      if(c.fields&SHM_VECTOR)
+      {
+        robot_command[robot].vector_data.store(c.vector);
+      }
+      if(c.fields&SHM_CALIB)
+      {
+        robot_command[robot].calib_data.store(c.calib_data);
+      }
+      if(c.fields&SHM_COMMAND)
+      {
+        storeKickerCommand(robot,c.command);
+      }
+      shm_commands[robot]++;
+      shm_age_max[robot]=std::max(shm_age_max[robot],now-c.stamp_ns);
+    }
+    return;
   }
-//  datatype=(datatype+1)%MAX_DATA_TYPE;
+#ifdef SIMULATE_WITHOUT_ROS
+  vectorCallback(robot);
+  visionCallback(robot);
+  kickerCallback(robot);
+#endif
+}
+
+void printDecoderStatistics(const FrameDecoder *dec)
+{
+  printf("rx frames %lu, checksum error %lu, broken %lu, unknown datatype %lu, dropped %lu bytes\n",
+         dec->frames,dec->checksum_errors,dec->broken_frames,dec->unknown_types,dec->dropped_bytes);
 }
 
 /*
-void setSendDataFromROSBus(vu8 *buf)
+ * Periodic scheduler
+ * Deadlines are absolute times on CLOCK_MONOTONIC (start + n*period). A
+ * timerfd armed with TFD_TIMER_ABSTIME and a fixed interval keeps that grid
+ * in the kernel, so the tick doesn't drift however long each cycle takes,
+ * and the event loop can wait on it together with the serial port.
+ */
+struct PeriodicTimer
 {
-  // edit this function
-  debug("setSendDataFromROSBus begin");
-  static char increment=0;
-  for(int i=0;i<DATA_SIZE-1;i++)
+  int fd;                       // timerfd, readable when a deadline passed
+  int64_t next_ns;              // next deadline
+  int64_t period_ns;
+  int policy;                   // OverrunPolicy
+  unsigned long overruns;       // ticks which found more than one deadline passed
+  unsigned long skipped;        // deadlines dropped by OVERRUN_SKIP
+};
+
+int64_t getMonotonicNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC,&ts);
+  return (int64_t)ts.tv_sec*1000000000LL+ts.tv_nsec;
+}
+
+inline struct timespec nsToTimespec(int64_t ns)
+{
+  struct timespec ts;
+  ts.tv_sec=ns/1000000000LL;
+  ts.tv_nsec=ns%1000000000LL;
+  return ts;
+}
+
+/* @initPeriodicTimer
+ * @brief Create timerfd and arm it from one period after now
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int initPeriodicTimer(PeriodicTimer *timer,int64_t period_ns,int policy)
+{
+  struct itimerspec its;
+
+  timer->period_ns=period_ns;
+  timer->policy=policy;
+  timer->overruns=0;
+  timer->skipped=0;
+  timer->next_ns=getMonotonicNs()+period_ns;
+  timer->fd=timerfd_create(CLOCK_MONOTONIC,TFD_NONBLOCK|TFD_CLOEXEC);
+  if(timer->fd<0)
   {
-    buf->push_back((uint8_t)createRandomNumber(0,255));
+    return -1;
   }
-  buf->push_back(increment);
-  increment=(increment+1)%0x100;
+  its.it_value=nsToTimespec(timer->next_ns);
+  its.it_interval=nsToTimespec(period_ns);
+  return timerfd_settime(timer->fd,TFD_TIMER_ABSTIME,&its,NULL);
 }
-*/
 
-int main(int argc, char** argv)
+/* @expirePeriodicTimer
+ * @brief Consume expirations of timerfd after epoll reported it readable
+ * @param[out] late Nanoseconds between the latest passed deadline and now
+ * @return Number of cycles to run now (0 if nothing expired)
+ * @detail OVERRUN_SKIP runs one cycle however many deadlines passed,
+ *         OVERRUN_CATCH_UP runs one cycle per passed deadline.
+ */
+int64_t expirePeriodicTimer(PeriodicTimer *timer,int64_t *late)
 {
-  //ros::init(argc,argv,"sub_node_name");
-  //ros::NodeHandle nh_vector,nh_vision,nh_kicker;
-  //ros::Subscriber sub_vector=nh_vector.subscribe("vector_pub_node_name",1000,vectorCallback);
-  //ros::Subscriber sub_vision=nh_vector.subscribe("vision_pub_node_name",1000,visionCallback);
-  //ros::Subscriber sub_kicker=nh_vector.subscribe("kicker_pub_node_name",1000,kickerCallback);
-  //ros::Rate rate(60);
+  uint64_t expirations=0;
+  int64_t deadline=0;
+
+  if(read(timer->fd,&expirations,sizeof(expirations))!=(ssize_t)sizeof(expirations)||expirations==0)
+  {
+    return 0;
+  }
+  deadline=timer->next_ns+(int64_t)(expirations-1)*timer->period_ns;
+  timer->next_ns=deadline+timer->period_ns;
+  *late=getMonotonicNs()-deadline;
+  if(*late<0)
+  {
+    *late=0;
+  }
+  if(expirations==1)
+  {
+    return 1;
+  }
+  timer->overruns++;
+  if(timer->policy==OVERRUN_SKIP)
+  {
+    timer->skipped+=expirations-1;
+    return 1;
+  }
+  return (int64_t)expirations;
+}
 
+/* @setPeriodicTimerPeriod
+ * @brief Change the period, the new grid starts one period after now
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int setPeriodicTimerPeriod(PeriodicTimer *timer,int64_t period_ns)
+{
+  struct itimerspec its;
 
-  debug("main\n");
-  int hz,looptime;
-  setParameterFromCommandLine(argc,argv,&hz,&loop_length);
-  debug("setParameterFromCommandLine end");
-  const int microsecond=(int)(1000000.0f/hz);
+  timer->period_ns=period_ns;
+  timer->next_ns=getMonotonicNs()+period_ns;
+  its.it_value=nsToTimespec(timer->next_ns);
+  its.it_interval=nsToTimespec(period_ns);
+  return timerfd_settime(timer->fd,TFD_TIMER_ABSTIME,&its,NULL);
+}
+
+/*
+ * Latency histogram
+ * Log-linear buckets like HdrHistogram: values below 16ns have one bucket
+ * each, above that every power of two is split into 16 sub-buckets, so
+ * each bucket is within 6.25% of the recorded value. Recording is a few
+ * integer ops with no lock and no allocation; only the loop thread writes
+ * cycle_histogram[], the writer thread records into its own and
+ * mergeHistogram() adds it after the thread is joined.
+ */
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_COUNT (1<<HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64-HISTOGRAM_SUB_BITS+1)*HISTOGRAM_SUB_COUNT)
 
-  vu8 send_buffer;
+struct LatencyHistogram
+{
+  const char *name;
+  uint64_t count;
+  uint64_t min;
+  uint64_t max;
+  uint64_t sum;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+};
 
-  // initialize serial communication
-  struct termios oldtio,newtio;         // Serial communication settings
-  debug("openDevice begin\n");
-  int fd=open(SERIAL_PORT,O_RDWR);      // open device
-  debug("openDevice end\n");
+void resetHistogram(LatencyHistogram *h)
+{
+  h->count=0;
+  h->min=UINT64_MAX;
+  h->max=0;
+  h->sum=0;
+  memset(h->buckets,0,sizeof(h->buckets));
+}
 
-  ioctl(fd,TCGETS,&oldtio);             // Evacuate current serial port settings
-  newtio=oldtio;                        // Copy current serial port settings
-  newtio.c_cflag=B115200|CREAD|CS8;         // Configure port settings. See man page termios(3)
-  ioctl(fd,TCSETS,&newtio);             // Enable port settings
+inline int histogramIndex(uint64_t v)
+{
+  int msb=0;
+  if(v<HISTOGRAM_SUB_COUNT)
+  {
+    return (int)v;
+  }
+  msb=63-__builtin_clzll(v);
+  return (msb-HISTOGRAM_SUB_BITS+1)*HISTOGRAM_SUB_COUNT
+        +(int)((v>>(msb-HISTOGRAM_SUB_BITS))&(HISTOGRAM_SUB_COUNT-1));
+}
 
-  struct timeval tv_start,tv_end; // for realtime sequence
-  int checksum=0;
-  uint8_t u8_checksum=0;
+// lowest value which falls in bucket idx
+inline uint64_t histogramValue(int idx)
+{
+  int group=idx/HISTOGRAM_SUB_COUNT;
+  int sub=idx%HISTOGRAM_SUB_COUNT;
+  if(group==0)
+  {
+    return (uint64_t)sub;
+  }
+  return (uint64_t)(HISTOGRAM_SUB_COUNT+sub)<<(group-1);
+}
 
+inline void recordHistogram(LatencyHistogram *h,int64_t ns)
+{
+  uint64_t v=ns>0?(uint64_t)ns:0;
+  h->buckets[histogramIndex(v)]++;
+  h->count++;
+  h->sum+=v;
+  if(v<h->min) h->min=v;
+  if(v>h->max) h->max=v;
+}
 
-  if (signal(SIGINT, signalHandler) == SIG_ERR)
+void mergeHistogram(LatencyHistogram *dst,const LatencyHistogram *src)
+{
+  for(int i=0;i<HISTOGRAM_BUCKETS;i++)
   {
-    printf("\ncan't catch SIGINT\n");
+    dst->buckets[i]+=src->buckets[i];
   }
-  if (signal(SIGQUIT, signalHandler) == SIG_ERR)
+  dst->count+=src->count;
+  dst->sum+=src->sum;
+  if(src->min<dst->min) dst->min=src->min;
+  if(src->max>dst->max) dst->max=src->max;
+}
+
+uint64_t histogramPercentile(const LatencyHistogram *h,double percent)
+{
+  uint64_t rank=(uint64_t)ceil(h->count*percent/100.0);
+  uint64_t seen=0;
+  if(rank==0)
   {
-    printf("\ncan't catch SIGQUIT\n");
+    rank=1;
   }
-  if (signal(SIGILL, signalHandler) == SIG_ERR)
+  for(int i=0;i<HISTOGRAM_BUCKETS;i++)
   {
-    printf("\ncan't catch SIGILL\n");
+    seen+=h->buckets[i];
+    if(seen>=rank)
+    {
+      return histogramValue(i)<h->min?h->min:histogramValue(i);
+    }
   }
-  if (signal(SIGTERM, signalHandler) == SIG_ERR)
+  return h->max;
+}
+
+void printHistogram(const LatencyHistogram *h)
+{
+  if(h->count==0)
   {
-    printf("\ncan't catch SIGTERM\n");
+    printf("%-10s no sample\n",h->name);
+    return;
   }
+  printf("%-10s n=%-8llu min=%9.1f avg=%9.1f p50=%9.1f p90=%9.1f p99=%9.1f p99.9=%9.1f max=%9.1f [us]\n",
+         h->name,(unsigned long long)h->count,
+         h->min/1000.0,(double)h->sum/h->count/1000.0,
+         histogramPercentile(h,50)/1000.0,histogramPercentile(h,90)/1000.0,
+         histogramPercentile(h,99)/1000.0,histogramPercentile(h,99.9)/1000.0,
+         h->max/1000.0);
+}
 
+enum CycleHistogram
+{
+  HIST_ENCODE,      // callbacks, packing and escaping of every frame
+  HIST_WRITE,       // writeAll()
+  HIST_PERIOD,      // start-to-start time of consecutive cycles
+  HIST_LATENESS,    // wake-up time minus deadline
+  HIST_NUM
+};
+LatencyHistogram cycle_histogram[HIST_NUM];
 
-  while(!errorFlag)
+void initCycleHistograms()
+{
+  const char *names[HIST_NUM]={"encode","write","period","lateness"};
+  for(int i=0;i<HIST_NUM;i++)
   {
-  // start timer
-    gettimeofday(&tv_start,NULL);
+    resetHistogram(&cycle_histogram[i]);
+    cycle_histogram[i].name=names[i];
+  }
+}
 
-    for(int i=0;i<MAX_DATA_TYPE;i++)
-    {
-    // get sending data from ROS bus
-    // make sending byte-data buffer from integer-data
-#ifdef SIMULATE_WITHOUT_ROS
-      switch(i)
-      {
-        case 0:
-          vectorCallback();break;
-        case 1:
-          visionCallback();break;
-        case 2:
-          kickerCallback();break;
-        default:
-          break;
-      }
-#endif
-      setSendDataFromROSBus((uint8_t)i,&send_buffer);
-
-    // send HEAD_BYTE as head-byte
-      write(fd,&HEAD_BYTE,1);
-      debug("write(fd,&HEAD_BYTE,1);");
-      checksum=HEAD_BYTE;
-      DBG("%4d", HEAD_BYTE);
-    // while buffer isn't empty, sends byte-data from buffer
-      for(auto itr=send_buffer.begin(); itr!=send_buffer.end(); ++itr)
-      {
-        debug("for loop begin");
-    // if data compete with HEAD_BYTE or ESCAPE_BYTE, run escape sequence
-        if(*itr==HEAD_BYTE||*itr==ESCAPE_BYTE)
-        {
-          write(fd,&ESCAPE_BYTE,1); // send escape byte
-          DBG("%4d", ESCAPE_BYTE);
-          *itr^=ESCAPE_MASK;        // escape mask
-        }
-    // send byte-data
-        write(fd,(uint8_t*)&*itr,1);
-        DBG("%4d", *itr);
-        checksum+=*itr;
-        debug("for loop end");
-      }
-      u8_checksum=checksum&0xFF;
-      if(u8_checksum==HEAD_BYTE||u8_checksum==ESCAPE_BYTE)
-      {
-        write(fd,&ESCAPE_BYTE,1);
-        DBG("%4d",ESCAPE_BYTE);
-        u8_checksum^=ESCAPE_MASK;
-      }
-      write(fd,&u8_checksum,1);
-      DBG("%4d\n", u8_checksum);
+void printCycleHistograms()
+{
+  for(int i=0;i<HIST_NUM;i++)
+  {
+    printHistogram(&cycle_histogram[i]);
+  }
+}
 
-      send_buffer.erase(send_buffer.begin(), send_buffer.end());  //delete all elements of vector
-    }
+/*
+ * Binary trace
+ * TRACE() copies an event (timestamp, link, type, aux word, raw bytes)
+ * into a single-producer ring with no lock, no syscall and no stdio; a
+ * full ring drops the event and counts it, the loop never waits. A drain
+ * thread writes the ring to trace_path every TRACE_DRAIN_MS and at exit,
+ * "usbserial-xbee trace FILE" prints it as text. Only the event loop
+ * thread records. Without ENABLE_TRACE (e.g. -DNDEBUG) TRACE() is empty.
+ * Record: TraceHeader, then len bytes, padded to 16 bytes.
+ */
+enum TraceType
+{
+  TRACE_PAD,          // rest of the ring is unused, continue at offset 0
+  TRACE_CYCLE,        // tick started, aux = lateness [ns]
+  TRACE_TX,           // escaped frames of one link in one tick
+  TRACE_WRITE,        // write() returned, aux = bytes written
+  TRACE_RX            // valid payload from a robot
+};
+
+struct TraceHeader
+{
+  int64_t ns;         // CLOCK_MONOTONIC
+  uint16_t link;      // robot, 0xFFFF for none
+  uint8_t type;
+  uint8_t len;
+  uint32_t aux;
+};
+static_assert(sizeof(TraceHeader)==16,"trace record header is 16 bytes");
 
-  // stop timer
-    gettimeofday(&tv_end,NULL);
+const char TRACE_MAGIC[8]={'X','B','T','R','A','C','E','1'};
+const char *trace_path=NULL;      // --trace, NULL records nothing
 
-  // calculate wait_time to keep realtime sequence
-    looptime=tv_end.tv_usec-tv_start.tv_usec;
-    if(looptime<microsecond)
+inline size_t traceRecordSize(size_t len)
+{
+  return (sizeof(TraceHeader)+len+15)&~(size_t)15;
+}
+
+#ifdef ENABLE_TRACE
+#define TRACE_RING_SIZE (1<<20)   // unit : Bytes, power of two
+#define TRACE_DRAIN_MS 20
+
+struct TraceRing
+{
+  alignas(64) uint8_t data[TRACE_RING_SIZE];
+  alignas(64) std::atomic<size_t> head;   // written by the event loop
+  alignas(64) std::atomic<size_t> tail;   // written by the drain thread
+  std::atomic<unsigned long> dropped;
+  bool active;
+  std::atomic<bool> stop;
+  FILE *fp;
+  pthread_t thread;
+};
+TraceRing trace_ring;
+
+void traceEvent(int type,int link,uint32_t aux,const uint8_t *bytes,size_t len)
+{
+  TraceRing &ring=trace_ring;
+  if(!ring.active)
+  {
+    return;
+  }
+  if(len>255)
+  {
+    len=255;
+  }
+  const size_t size=traceRecordSize(len);
+  size_t head=ring.head.load(std::memory_order_relaxed);
+  size_t offset=head&(TRACE_RING_SIZE-1);
+  const size_t pad=offset+size>TRACE_RING_SIZE?TRACE_RING_SIZE-offset:0;
+  if(head+pad+size-ring.tail.load(std::memory_order_acquire)>TRACE_RING_SIZE)
+  {
+    ring.dropped.fetch_add(1,std::memory_order_relaxed);
+    return;
+  }
+  if(pad>0)
+  {
+    TraceHeader *fill=(TraceHeader*)(ring.data+offset);
+    fill->type=TRACE_PAD;
+    head+=pad;
+    offset=0;
+  }
+  TraceHeader *h=(TraceHeader*)(ring.data+offset);
+  h->ns=getMonotonicNs();
+  h->link=(uint16_t)link;
+  h->type=(uint8_t)type;
+  h->len=(uint8_t)len;
+  h->aux=aux;
+  if(len>0)
+  {
+    memcpy(h+1,bytes,len);
+  }
+  ring.head.store(head+size,std::memory_order_release);
+}
+
+#define TRACE(type,link,aux,bytes,len) traceEvent(type,link,aux,bytes,len)
+
+/* @drainTrace
+ * @brief Move every complete record from the ring to the trace file
+ */
+void drainTrace(TraceRing *ring)
+{
+  size_t tail=ring->tail.load(std::memory_order_relaxed);
+  const size_t head=ring->head.load(std::memory_order_acquire);
+
+  while(tail<head)
+  {
+    const size_t offset=tail&(TRACE_RING_SIZE-1);
+    const TraceHeader *h=(const TraceHeader*)(ring->data+offset);
+    if(h->type==TRACE_PAD)
     {
-      usleep(microsecond-looptime);
+      tail+=TRACE_RING_SIZE-offset;
+      continue;
     }
-    loop_count++;
-    if(loop_count_enable&&loop_count>=loop_length)
+    const size_t size=traceRecordSize(h->len);
+    fwrite(h,1,size,ring->fp);
+#ifdef ENABLE_DBG
+    const uint8_t *bytes=(const uint8_t*)(h+1);
+    for(size_t i=0;h->type==TRACE_TX&&i<h->len;i++)
     {
-      printf("\nloopcount reach max\n");
-      break;
+      DBG("%4d", bytes[i]);
     }
-    debug("while loop end");
+    if(h->type==TRACE_TX)
+    {
+      DBG("\n");
+    }
+#endif
+    tail+=size;
   }
+  ring->tail.store(tail,std::memory_order_release);
+}
 
-  if(loop_count<loop_length)
-  {
+void *traceDrainThread(void *arg)
+{
+  TraceRing *ring=(TraceRing*)arg;
+  const struct timespec interval=nsToTimespec((int64_t)TRACE_DRAIN_MS*1000000LL);
+
+  while(!ring->stop.load(std::memory_order_acquire))
+  {
+    nanosleep(&interval,NULL);
+    drainTrace(ring);
+    fflush(ring->fp);
+  }
+  return NULL;
+}
+
+/* @startTrace
+ * @return 0 on success or without trace_path, -1 on error (errno is set)
+ */
+int startTrace()
+{
+  TraceRing &ring=trace_ring;
+  ring.head.store(0);
+  ring.tail.store(0);
+  ring.dropped.store(0);
+  ring.stop.store(false);
+  ring.active=false;
+  if(trace_path==NULL)
+  {
+    return 0;
+  }
+  ring.fp=fopen(trace_path,"wb");
+  if(ring.fp==NULL)
+  {
+    return -1;
+  }
+  fwrite(TRACE_MAGIC,1,sizeof(TRACE_MAGIC),ring.fp);
+  if(pthread_create(&ring.thread,NULL,traceDrainThread,&ring)!=0)
+  {
+    fclose(ring.fp);
+    errno=EAGAIN;
+    return -1;
+  }
+  ring.active=true;
+  return 0;
+}
+
+void stopTrace()
+{
+  TraceRing &ring=trace_ring;
+  if(!ring.active)
+  {
+    return;
+  }
+  ring.active=false;
+  ring.stop.store(true,std::memory_order_release);
+  pthread_join(ring.thread,NULL);
+  drainTrace(&ring);
+  fclose(ring.fp);
+  printf("trace %s, dropped %lu events\n",trace_path,ring.dropped.load());
+}
+#else
+#define TRACE(type,link,aux,bytes,len) ((void)0)
+
+int startTrace()
+{
+  if(trace_path!=NULL)
+  {
+    printf("built without ENABLE_TRACE, --trace is ignored\n");
+  }
+  return 0;
+}
+
+void stopTrace()
+{
+}
+#endif
+
+/* @printTraceFile
+ * @brief "usbserial-xbee trace FILE": print a trace as one line per event
+ * @return 0 on success, 1 if FILE is not a trace
+ */
+int printTraceFile(const char *path)
+{
+  static const char *names[]={"pad","cycle","tx","write","rx"};
+  char magic[sizeof(TRACE_MAGIC)];
+  TraceHeader h;
+  uint8_t bytes[256];
+  int64_t first=-1;
+  FILE *fp=fopen(path,"rb");
+
+  if(fp==NULL||fread(magic,1,sizeof(magic),fp)!=sizeof(magic)||memcmp(magic,TRACE_MAGIC,sizeof(magic))!=0)
+  {
+    fprintf(stderr,"[%s] %s:%u # %s: not a trace file\n",__DATE__,__FILE__,__LINE__,path);
+    if(fp!=NULL)
+    {
+      fclose(fp);
+    }
+    return 1;
+  }
+  while(fread(&h,sizeof(h),1,fp)==1)
+  {
+    const size_t rest=traceRecordSize(h.len)-sizeof(h);
+    if(fread(bytes,1,rest,fp)!=rest)
+    {
+      break;
+    }
+    if(first<0)
+    {
+      first=h.ns;
+    }
+    printf("%12.6f %-5s",(h.ns-first)/1e9,h.type<sizeof(names)/sizeof(names[0])?names[h.type]:"?");
+    if(h.link!=0xFFFF)
+    {
+      printf(" link %u",h.link);
+    }
+    if(h.type==TRACE_CYCLE)
+    {
+      printf(" late %.1f[us]",h.aux/1000.0);
+    }
+    else if(h.type==TRACE_WRITE)
+    {
+      printf(" %u bytes",h.aux);
+    }
+    for(size_t i=0;i<h.len;i++)
+    {
+      printf(i==0?" :%4d":"%4d",bytes[i]);
+    }
+    printf("\n");
+  }
+  fclose(fp);
+  return 0;
+}
+
+/*
+ * Capture log
+ * --capture FILE appends every frame written to a port (and every payload
+ * received) to a memory-mapped file. The event loop only memcpy()s into
+ * the mapping, the page cache does the writing; a side thread maps the
+ * next segment ahead of time, msync()s what was written every
+ * CAPTURE_SYNC_MS and unmaps finished segments. A record that would land
+ * in a segment that is not mapped yet is dropped and counted. Every page
+ * of a segment is written once before the event loop may use it, so
+ * transmit never takes the first-write page fault.
+ * "usbserial-xbee replay FILE [speed]" sends the tx records again.
+ * File: CAPTURE_MAGIC, then CaptureRecord + len bytes, back to back. A
+ * log cut by a crash ends in zeros, a record of len 0 at ns 0 marks it.
+ */
+#define CAPTURE_SEGMENT_SIZE (4<<20)   // unit : Bytes, multiple of the page size
+#define CAPTURE_SYNC_MS 200
+
+enum CaptureDirection
+{
+  CAPTURE_TX,         // bytes written to serial port index `port`
+  CAPTURE_RX          // payload decoded from robot `port`
+};
+
+struct CaptureRecord
+{
+  int64_t ns;         // CLOCK_MONOTONIC
+  uint16_t port;
+  uint8_t direction;
+  uint8_t reserved;
+  uint32_t len;
+};
+static_assert(sizeof(CaptureRecord)==16,"capture record header is 16 bytes");
+
+const char CAPTURE_MAGIC[8]={'X','B','C','A','P','T','1','\0'};
+const char *capture_path=NULL;    // --capture, NULL records nothing
+
+struct CaptureLog
+{
+  int fd;
+  uint8_t *segment[2];                // segment k is mapped at segment[k&1]
+  uint64_t base;                      // lowest mapped segment, side thread only
+  alignas(64) std::atomic<uint64_t> mapped;   // segments below this are mapped
+  alignas(64) std::atomic<uint64_t> written;  // file offset, event loop only
+  unsigned long records;
+  unsigned long dropped;
+  bool active;
+  std::atomic<bool> stop;
+  pthread_t thread;
+};
+CaptureLog capture_log;
+
+/* @mapCaptureSegment
+ * @brief Grow the file, map segment k and fault in all of its pages
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int mapCaptureSegment(CaptureLog *log,uint64_t k)
+{
+  if(ftruncate(log->fd,(off_t)((k+1)*CAPTURE_SEGMENT_SIZE))<0)
+  {
+    return -1;
+  }
+  void *p=mmap(NULL,CAPTURE_SEGMENT_SIZE,PROT_READ|PROT_WRITE,MAP_SHARED,log->fd,(off_t)(k*CAPTURE_SEGMENT_SIZE));
+  if(p==MAP_FAILED)
+  {
+    return -1;
+  }
+  // a write fault per page here instead of in captureFrame()
+  const long page=sysconf(_SC_PAGESIZE);
+  for(size_t offset=0;offset<CAPTURE_SEGMENT_SIZE;offset+=page)
+  {
+    ((volatile uint8_t*)p)[offset]=0;
+  }
+  log->segment[k&1]=(uint8_t*)p;
+  return 0;
+}
+
+/* @copyToCapture
+ * @brief Copy bytes at file offset `at`, which may cross into the next segment
+ */
+inline void copyToCapture(CaptureLog *log,uint64_t at,const void *bytes,size_t len)
+{
+  const uint8_t *src=(const uint8_t*)bytes;
+  while(len>0)
+  {
+    const uint64_t k=at/CAPTURE_SEGMENT_SIZE;
+    const size_t offset=(size_t)(at%CAPTURE_SEGMENT_SIZE);
+    const size_t n=std::min(len,(size_t)CAPTURE_SEGMENT_SIZE-offset);
+    memcpy(log->segment[k&1]+offset,src,n);
+    src+=n;
+    at+=n;
+    len-=n;
+  }
+}
+
+/* @captureFrame
+ * @brief Append one record, no syscall
+ * @detail Called from the event loop thread only.
+ */
+void captureFrame(int direction,int port,const uint8_t *bytes,size_t len)
+{
+  CaptureLog &log=capture_log;
+  if(!log.active||len==0)
+  {
+    return;
+  }
+  const uint64_t at=log.written.load(std::memory_order_relaxed);
+  const uint64_t end=at+sizeof(CaptureRecord)+len;
+  if((end-1)/CAPTURE_SEGMENT_SIZE>=log.mapped.load(std::memory_order_acquire))
+  {
+    log.dropped++;
+    return;
+  }
+  CaptureRecord rec;
+  rec.ns=getMonotonicNs();
+  rec.port=(uint16_t)port;
+  rec.direction=(uint8_t)direction;
+  rec.reserved=0;
+  rec.len=(uint32_t)len;
+  copyToCapture(&log,at,&rec,sizeof(rec));
+  copyToCapture(&log,at+sizeof(rec),bytes,len);
+  log.records++;
+  log.written.store(end,std::memory_order_release);
+}
+
+/* @syncCapture
+ * @brief Flush written pages, unmap passed segments, map the next one
+ * @detail Keeps segments base and base+1 mapped, so the event loop can
+ *         always cross one segment boundary.
+ */
+void syncCapture(CaptureLog *log,int flags)
+{
+  const uint64_t written=log->written.load(std::memory_order_acquire);
+  const uint64_t current=written/CAPTURE_SEGMENT_SIZE;
+
+  while(log->base<current)
+  {
+    msync(log->segment[log->base&1],CAPTURE_SEGMENT_SIZE,flags);
+    munmap(log->segment[log->base&1],CAPTURE_SEGMENT_SIZE);
+    log->base++;
+  }
+  if(written%CAPTURE_SEGMENT_SIZE>0)
+  {
+    msync(log->segment[current&1],(size_t)(written%CAPTURE_SEGMENT_SIZE),flags);
+  }
+  for(uint64_t k=log->mapped.load(std::memory_order_relaxed);k<log->base+2;k++)
+  {
+    if(mapCaptureSegment(log,k)<0)
+    {
+      break;                            // records are dropped until it works
+    }
+    log->mapped.store(k+1,std::memory_order_release);
+  }
+}
+
+void *captureSyncThread(void *arg)
+{
+  CaptureLog *log=(CaptureLog*)arg;
+  const struct timespec interval=nsToTimespec((int64_t)CAPTURE_SYNC_MS*1000000LL);
+
+  while(!log->stop.load(std::memory_order_acquire))
+  {
+    nanosleep(&interval,NULL);
+    syncCapture(log,MS_ASYNC);
+  }
+  return NULL;
+}
+
+/* @startCapture
+ * @return 0 on success or without capture_path, -1 on error (errno is set)
+ */
+int startCapture()
+{
+  CaptureLog &log=capture_log;
+  log.active=false;
+  log.base=0;
+  log.mapped.store(0);
+  log.written.store(0);
+  log.records=0;
+  log.dropped=0;
+  log.stop.store(false);
+  if(capture_path==NULL)
+  {
+    return 0;
+  }
+  log.fd=open(capture_path,O_RDWR|O_CREAT|O_TRUNC,0644);
+  if(log.fd<0)
+  {
+    return -1;
+  }
+  if(mapCaptureSegment(&log,0)<0||mapCaptureSegment(&log,1)<0)
+  {
+    close(log.fd);
+    return -1;
+  }
+  log.mapped.store(2);
+  memcpy(log.segment[0],CAPTURE_MAGIC,sizeof(CAPTURE_MAGIC));
+  log.written.store(sizeof(CAPTURE_MAGIC));
+  if(pthread_create(&log.thread,NULL,captureSyncThread,&log)!=0)
+  {
+    close(log.fd);
+    errno=EAGAIN;
+    return -1;
+  }
+  log.active=true;
+  return 0;
+}
+
+/* @stopCapture
+ * @brief Sync everything, unmap and cut the file to what was written
+ */
+void stopCapture()
+{
+  CaptureLog &log=capture_log;
+  if(!log.active)
+  {
+    return;
+  }
+  log.active=false;
+  log.stop.store(true,std::memory_order_release);
+  pthread_join(log.thread,NULL);
+  syncCapture(&log,MS_SYNC);
+  for(uint64_t k=log.base;k<log.mapped.load();k++)
+  {
+    munmap(log.segment[k&1],CAPTURE_SEGMENT_SIZE);
+  }
+  if(ftruncate(log.fd,(off_t)log.written.load())<0)
+  {
+    fprintf(stderr,"[%s] %s:%u # capture %s: %s\n",__DATE__,__FILE__,__LINE__,capture_path,strerror(errno));
+  }
+  close(log.fd);
+  printf("capture %s, %lu records, dropped %lu\n",capture_path,log.records,log.dropped);
+}
+
+/*
+ * Metrics
+ * Live counters for Prometheus. Every block below has exactly one writer
+ * thread, which updates it with relaxed atomic load/store (no lock
+ * prefix, no lock, no allocation); the HTTP thread on metrics_port only
+ * loads them and builds the text when /metrics is scraped. Link blocks
+ * mirror the link statistics at the end of every encodeCycle().
+ */
+typedef std::atomic<uint64_t> MetricCounter;
+
+// single writer, so no read-modify-write instruction is needed
+inline void addMetric(MetricCounter *c,uint64_t n)
+{
+  c->store(c->load(std::memory_order_relaxed)+n,std::memory_order_relaxed);
+}
+
+inline void setMetric(MetricCounter *c,uint64_t v)
+{
+  c->store(v,std::memory_order_relaxed);
+}
+
+const int64_t METRIC_BUCKET_NS[]={25000,50000,100000,250000,500000,1000000,2500000,5000000,10000000,25000000,50000000};
+#define METRIC_BUCKETS (sizeof(METRIC_BUCKET_NS)/sizeof(METRIC_BUCKET_NS[0]))
+
+struct MetricHistogram
+{
+  MetricCounter count;
+  MetricCounter sum_ns;
+  MetricCounter bucket[METRIC_BUCKETS+1];   // not cumulative, last is +Inf
+};
+
+inline void recordMetric(MetricHistogram *h,int64_t ns)
+{
+  size_t i=0;
+  while(i<METRIC_BUCKETS&&ns>METRIC_BUCKET_NS[i])
+  {
+    i++;
+  }
+  addMetric(&h->bucket[i],1);
+  addMetric(&h->sum_ns,ns>0?(uint64_t)ns:0);
+  addMetric(&h->count,1);
+}
+
+struct LinkMetrics
+{
+  MetricCounter frames[MAX_DATA_TYPE];    // sent per datatype
+  MetricCounter tx_bytes;                 // escaped bytes
+  MetricCounter rx_frames;
+  MetricCounter checksum_errors;
+  MetricCounter broken_frames;
+  MetricCounter outq_bytes;               // TIOCOUTQ at the last tick
+  MetricCounter outq_skipped;
+  std::atomic<double> error_percent;      // link quality of the last window
+  std::atomic<double> ack_ms;
+  std::atomic<int> rssi_dbm;
+  std::atomic<int> backoff;
+};
+
+struct ThreadMetrics
+{
+  MetricHistogram write_latency;
+  MetricCounter write_errors;
+};
+
+struct LoopMetrics
+{
+  MetricCounter cycles;
+  MetricCounter deadline_misses;          // PeriodicTimer::overruns
+  MetricCounter skipped_cycles;
+  MetricCounter api_outq_bytes;
+  MetricHistogram lateness;
+};
+
+int metrics_port=METRICS_PORT;
+LinkMetrics link_metrics[MAX_LINKS];    // event loop
+LoopMetrics loop_metrics;                // event loop
+ThreadMetrics loop_thread_metrics;       // event loop
+ThreadMetrics writer_thread_metrics;     // writer thread of pipeline_mode
+
+struct MetricsServer
+{
+  int fd;
+  bool active;
+  std::atomic<bool> stop;
+  unsigned long scrapes;
+  pthread_t thread;
+};
+MetricsServer metrics_server;
+
+void appendMetricText(std::string *out,const char *fmt,...)
+{
+  char line[256];
+  va_list ap,again;
+  va_start(ap,fmt);
+  va_copy(again,ap);
+  int n=vsnprintf(line,sizeof(line),fmt,ap);
+  if(n>=(int)sizeof(line))
+  {
+    const size_t at=out->size();
+    out->resize(at+n+1);
+    vsnprintf(&(*out)[at],n+1,fmt,again);
+    out->resize(at+n);
+  }
+  else if(n>0)
+  {
+    out->append(line,n);
+  }
+  va_end(again);
+  va_end(ap);
+}
+
+// the sum of several per-thread histograms as one Prometheus histogram
+void appendMetricHistogram(std::string *out,const char *name,const char *help,
+                           const MetricHistogram *const *h,int count)
+{
+  uint64_t cumulative=0,total=0,sum_ns=0;
+  appendMetricText(out,"# HELP %s %s\n# TYPE %s histogram\n",name,help,name);
+  for(size_t b=0;b<=METRIC_BUCKETS;b++)
+  {
+    for(int i=0;i<count;i++)
+    {
+      cumulative+=h[i]->bucket[b].load(std::memory_order_relaxed);
+    }
+    if(b<METRIC_BUCKETS)
+    {
+      appendMetricText(out,"%s_bucket{le=\"%g\"} %llu\n",name,METRIC_BUCKET_NS[b]/1e9,(unsigned long long)cumulative);
+    }
+  }
+  for(int i=0;i<count;i++)
+  {
+    total+=h[i]->count.load(std::memory_order_relaxed);
+    sum_ns+=h[i]->sum_ns.load(std::memory_order_relaxed);
+  }
+  total=std::max(total,cumulative);     // read while being written
+  appendMetricText(out,"%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9f\n%s_count %llu\n",
+                   name,(unsigned long long)total,name,sum_ns/1e9,name,(unsigned long long)total);
+}
+
+/* @formatMetrics
+ * @brief Prometheus text format (version 0.0.4) of every metric
+ */
+void formatMetrics(std::string *out)
+{
+  struct
+  {
+    const char *name;
+    const char *type;
+    const char *help;
+    MetricCounter LinkMetrics::*counter;
+  } const link_counters[]={
+    {"xbee_tx_bytes_total","counter","Escaped bytes sent to the robot.",&LinkMetrics::tx_bytes},
+    {"xbee_rx_frames_total","counter","Valid frames received from the robot.",&LinkMetrics::rx_frames},
+    {"xbee_checksum_errors_total","counter","Frames from the robot with a wrong checksum.",&LinkMetrics::checksum_errors},
+    {"xbee_broken_frames_total","counter","Frames from the robot with broken framing.",&LinkMetrics::broken_frames},
+    {"xbee_tty_outq_bytes","gauge","Bytes in the tty output queue (TIOCOUTQ) at the last tick.",&LinkMetrics::outq_bytes},
+    {"xbee_outq_skipped_cycles_total","counter","Cycles skipped because the tty output queue was full.",&LinkMetrics::outq_skipped},
+  };
+
+  out->clear();
+  appendMetricText(out,"# HELP xbee_frames_sent_total Records sent per robot and datatype.\n"
+                       "# TYPE xbee_frames_sent_total counter\n");
+  for(int r=0;r<num_links;r++)
+  {
+    for(int i=0;i<MAX_DATA_TYPE;i++)
+    {
+      appendMetricText(out,"xbee_frames_sent_total{robot=\"%d\",datatype=\"%d\"} %llu\n",r,i,
+                       (unsigned long long)link_metrics[r].frames[i].load(std::memory_order_relaxed));
+    }
+  }
+  for(size_t k=0;k<sizeof(link_counters)/sizeof(link_counters[0]);k++)
+  {
+    appendMetricText(out,"# HELP %s %s\n# TYPE %s %s\n",link_counters[k].name,link_counters[k].help,
+                     link_counters[k].name,link_counters[k].type);
+    for(int r=0;r<num_links;r++)
+    {
+      appendMetricText(out,"%s{robot=\"%d\"} %llu\n",link_counters[k].name,r,
+                       (unsigned long long)(link_metrics[r].*link_counters[k].counter).load(std::memory_order_relaxed));
+    }
+  }
+  appendMetricText(out,"# HELP xbee_link_quality Link quality of the last window: error_percent, ack_ms (-1 no sample), rssi_dbm (0 unknown), backoff.\n"
+                       "# TYPE xbee_link_quality gauge\n");
+  for(int r=0;r<num_links;r++)
+  {
+    const LinkMetrics &m=link_metrics[r];
+    appendMetricText(out,"xbee_link_quality{robot=\"%d\",value=\"error_percent\"} %g\n"
+                         "xbee_link_quality{robot=\"%d\",value=\"ack_ms\"} %g\n"
+                         "xbee_link_quality{robot=\"%d\",value=\"rssi_dbm\"} %d\n"
+                         "xbee_link_quality{robot=\"%d\",value=\"backoff\"} %d\n",
+                     r,m.error_percent.load(std::memory_order_relaxed),r,m.ack_ms.load(std::memory_order_relaxed),
+                     r,m.rssi_dbm.load(std::memory_order_relaxed),r,m.backoff.load(std::memory_order_relaxed));
+  }
+  if(xbee_api_mode)
+  {
+    appendMetricText(out,"# HELP xbee_api_tty_outq_bytes Bytes in the tty output queue of the coordinator.\n"
+                         "# TYPE xbee_api_tty_outq_bytes gauge\nxbee_api_tty_outq_bytes %llu\n",
+                     (unsigned long long)loop_metrics.api_outq_bytes.load(std::memory_order_relaxed));
+  }
+  appendMetricText(out,"# HELP xbee_cycles_total Transmit cycles run.\n# TYPE xbee_cycles_total counter\nxbee_cycles_total %llu\n"
+                       "# HELP xbee_deadline_misses_total Ticks which found more than one deadline passed.\n"
+                       "# TYPE xbee_deadline_misses_total counter\nxbee_deadline_misses_total %llu\n"
+                       "# HELP xbee_skipped_cycles_total Deadlines dropped by the skip overrun policy.\n"
+                       "# TYPE xbee_skipped_cycles_total counter\nxbee_skipped_cycles_total %llu\n"
+                       "# HELP xbee_write_errors_total Failed write() of a cycle.\n"
+                       "# TYPE xbee_write_errors_total counter\nxbee_write_errors_total %llu\n",
+                   (unsigned long long)loop_metrics.cycles.load(std::memory_order_relaxed),
+                   (unsigned long long)loop_metrics.deadline_misses.load(std::memory_order_relaxed),
+                   (unsigned long long)loop_metrics.skipped_cycles.load(std::memory_order_relaxed),
+                   (unsigned long long)(loop_thread_metrics.write_errors.load(std::memory_order_relaxed)
+                                        +writer_thread_metrics.write_errors.load(std::memory_order_relaxed)));
+  const MetricHistogram *writes[]={&loop_thread_metrics.write_latency,&writer_thread_metrics.write_latency};
+  const MetricHistogram *lateness[]={&loop_metrics.lateness};
+  appendMetricHistogram(out,"xbee_write_seconds","Time of the write() of one cycle.",writes,2);
+  appendMetricHistogram(out,"xbee_tick_lateness_seconds","Wake-up after the deadline of a tick.",lateness,1);
+}
+
+/* @serveMetricsClient
+ * @brief Answer one HTTP request, GET /metrics or 404
+ */
+void serveMetricsClient(int fd,std::string *body)
+{
+  char request[1024];
+  char header[160];
+  struct pollfd pfd={fd,POLLIN,0};
+  ssize_t n=0;
+  bool found=false;
+
+  if(poll(&pfd,1,1000)<=0||(n=read(fd,request,sizeof(request)-1))<=0)
+  {
+    return;
+  }
+  request[n]='\0';
+  found=strncmp(request,"GET /metrics ",13)==0||strncmp(request,"GET /metrics?",13)==0;
+  if(found)
+  {
+    formatMetrics(body);
+  }
+  else
+  {
+    body->assign("not found, try /metrics\n");
+  }
+  int len=snprintf(header,sizeof(header),"HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                   "Content-Length: %zu\r\nConnection: close\r\n\r\n",found?"200 OK":"404 Not Found",body->size());
+  // blocking socket, a slow scraper only delays this thread
+  if(write(fd,header,len)==len&&write(fd,body->data(),body->size())<0)
+  {
+    debug("metrics write failed");
+  }
+  metrics_server.scrapes+=found;
+}
+
+void *metricsThread(void *arg)
+{
+  MetricsServer *server=(MetricsServer*)arg;
+  std::string body;
+  struct pollfd pfd={server->fd,POLLIN,0};
+
+  while(!server->stop.load(std::memory_order_acquire))
+  {
+    if(poll(&pfd,1,200)<=0)
+    {
+      continue;
+    }
+    int client=accept4(server->fd,NULL,NULL,SOCK_CLOEXEC);
+    if(client<0)
+    {
+      continue;
+    }
+    serveMetricsClient(client,&body);
+    close(client);
+  }
+  return NULL;
+}
+
+/* @startMetrics
+ * @brief Listen on metrics_port and serve it from a non real-time thread
+ * @return 0 on success or with metrics_port 0, -1 on error (errno is set)
+ * @detail Call before applyThreadSettings(), so the thread is not pinned
+ *         to the encoder CPU.
+ */
+int startMetrics()
+{
+  MetricsServer &server=metrics_server;
+  struct sockaddr_in addr;
+  int one=1;
+
+  server.active=false;
+  server.scrapes=0;
+  server.stop.store(false);
+  if(metrics_port<=0)
+  {
+    return 0;
+  }
+  server.fd=socket(AF_INET,SOCK_STREAM|SOCK_CLOEXEC,0);
+  if(server.fd<0)
+  {
+    return -1;
+  }
+  memset(&addr,0,sizeof(addr));
+  addr.sin_family=AF_INET;
+  addr.sin_addr.s_addr=htonl(INADDR_ANY);
+  addr.sin_port=htons((uint16_t)metrics_port);
+  if(setsockopt(server.fd,SOL_SOCKET,SO_REUSEADDR,&one,sizeof(one))<0
+     ||bind(server.fd,(struct sockaddr*)&addr,sizeof(addr))<0
+     ||listen(server.fd,4)<0)
+  {
+    close(server.fd);
+    return -1;
+  }
+  if(pthread_create(&server.thread,NULL,metricsThread,&server)!=0)
+  {
+    close(server.fd);
+    errno=EAGAIN;
+    return -1;
+  }
+  server.active=true;
+  return 0;
+}
+
+void stopMetrics()
+{
+  MetricsServer &server=metrics_server;
+  if(!server.active)
+  {
+    return;
+  }
+  server.stop.store(true,std::memory_order_release);
+  pthread_join(server.thread,NULL);
+  close(server.fd);
+  server.active=false;
+  printf("metrics port %d, %lu scrapes\n",metrics_port,server.scrapes);
+}
+
+/*
+void setSendDataFromROSBus(vu8 *buf)
+{
+  // edit this function
+  debug("setSendDataFromROSBus begin");
+  static char increment=0;
+  for(int i=0;i<DATA_SIZE-1;i++)
+  {
+    buf->push_back((uint8_t)createRandomNumber(0,255));
+  }
+  buf->push_back(increment);
+  increment=(increment+1)%0x100;
+}
+*/
+
+/*
+ * Output queue backpressure
+ * If write() is faster than the baud rate, bytes pile up in the tty output
+ * queue and commands arrive late. Before each cycle the queue depth is
+ * read with TIOCOUTQ. While it holds more than outq_limit_cycles periods
+ * of bytes the cycle is skipped; the next cycle samples the callbacks
+ * again, so only the freshest values go out. Beyond outq_flush_cycles the
+ * queue is discarded with tcflush(); a frame cut there is dropped by the
+ * robot, which resynchronizes on the next HEAD_BYTE. The caller is told,
+ * because the robot never got the flushed frames (see resendAfterFlush()).
+ */
+enum OutputQueueCheck
+{
+  OUTQ_SEND,          // send this cycle
+  OUTQ_SKIP,          // queue too deep, skip this cycle
+  OUTQ_FLUSHED        // queue was discarded, send this cycle
+};
+
+struct OutputQueueStats
+{
+  unsigned long samples;
+  unsigned long sum;            // unit : Bytes
+  unsigned long max;
+  unsigned long last;
+  unsigned long drops;          // cycles skipped
+  unsigned long flushes;
+};
+
+void initOutputQueueStats(OutputQueueStats *st)
+{
+  st->samples=0;
+  st->sum=0;
+  st->max=0;
+  st->last=0;
+  st->drops=0;
+  st->flushes=0;
+}
+
+void setOutputQueueBudget(int hz)
+{
+  if(hz<=0)
+  {
+    outq_cycle_bytes=0;                   // no period, no check
+    return;
+  }
+  outq_cycle_bytes=baud_rate/10/hz;       // 8N1 is 10 bits per byte
+  if(outq_cycle_bytes<(int)TX_BUFFER_SIZE)
+  {
+    outq_cycle_bytes=TX_BUFFER_SIZE;      // one full cycle may always be queued
+  }
+}
+
+/* @checkOutputQueue
+ * @return OutputQueueCheck of this cycle
+ * @detail Ports without TIOCOUTQ are always sent.
+ */
+int checkOutputQueue(int fd,OutputQueueStats *st)
+{
+  int queued=0;
+  const long limit=(long)outq_cycle_bytes*outq_limit_cycles;
+
+  if(outq_cycle_bytes<=0)
+  {
+    return OUTQ_SEND;
+  }
+  txSyscalls().fetch_add(1,std::memory_order_relaxed);
+  if(ioctl(fd,TIOCOUTQ,&queued)<0)
+  {
+    return OUTQ_SEND;
+  }
+  st->samples++;
+  st->sum+=queued;
+  st->last=queued;
+  if((unsigned long)queued>st->max)
+  {
+    st->max=queued;
+  }
+  if(outq_flush_cycles>0&&queued>(long)outq_cycle_bytes*outq_flush_cycles)
+  {
+    tcflush(fd,TCOFLUSH);
+    st->flushes++;
+    return OUTQ_FLUSHED;
+  }
+  if(queued>limit)
+  {
+    st->drops++;
+    return OUTQ_SKIP;
+  }
+  return OUTQ_SEND;
+}
+
+void printOutputQueueStats(const OutputQueueStats *st)
+{
+  printf("  tty output queue avg %.1f, max %lu bytes, skipped %lu cycles, flushed %lu times\n",
+         st->samples>0?(double)st->sum/st->samples:0.0,st->max,st->drops,st->flushes);
+}
+
+/*
+ * Change-driven transmission
+ * With send_only_changed, a datatype is sent only when its packed payload
+ * differs from the last one sent, or when keepalive_ms[] passed since then.
+ * The radio time left over is free for the velocity vector.
+ */
+bool send_only_changed=SEND_ONLY_CHANGED;
+bool multi_record=MULTI_RECORD;
+unsigned datatype_mask=(1u<<MAX_DATA_TYPE)-1;   // bit i set sends datatype i
+int keepalive_ms[MAX_DATA_TYPE]={KEEPALIVE_MS_VECTOR,KEEPALIVE_MS_CALIB,KEEPALIVE_MS_KICKER};
+int rate_hz[MAX_DATA_TYPE]={RATE_HZ_VECTOR,RATE_HZ_CALIB,RATE_HZ_KICKER};
+
+/*
+ * Multi-rate tick wheel
+ * Each datatype fires every round(cycle_hz/rate_hz[i]) ticks of the
+ * periodic timer; rate 0 or above cycle_hz fires every tick. A hashed
+ * wheel of WHEEL_SLOTS slots holds the datatypes due per tick as a bit
+ * mask, with a rounds count for periods longer than the wheel, so a tick
+ * costs one slot lookup whatever the rates. A datatype is rescheduled
+ * from the tick it fires; a rate changed by SIGHUP applies from then on.
+ * Everything due in the same tick goes out in one write(). The bytes of
+ * a link are held under tick_budget_bytes, what the UART sends in one
+ * period, by a token bucket which may save up to two ticks (or two
+ * frames) of credit. A datatype that doesn't fit moves to the next tick
+ * with everything behind it and goes first there, so neither velocity
+ * nor the small frames can starve the others.
+ */
+#define WHEEL_SLOTS 64
+int tick_budget_bytes=0;          // 0 is unlimited
+
+struct TickWheel
+{
+  unsigned long tick;
+  uint8_t slot[WHEEL_SLOTS];      // bit i: datatype i is in this slot
+  unsigned rounds[MAX_DATA_TYPE]; // wheel turns left before datatype i fires
+  unsigned late;                  // datatypes deferred by the last tick
+  int credit;                     // unit : Bytes, token bucket of tick_budget_bytes
+};
+
+void initTickWheel(TickWheel *wheel)
+{
+  wheel->tick=0;
+  wheel->late=0;
+  wheel->credit=0;
+  memset(wheel->slot,0,sizeof(wheel->slot));
+  for(int i=0;i<MAX_DATA_TYPE;i++)
+  {
+    wheel->slot[0]|=1u<<i;        // everything fires on the first tick
+    wheel->rounds[i]=0;
+  }
+}
+
+inline unsigned long periodTicks(int datatype)
+{
+  const int rate=rate_hz[datatype];
+  if(rate<=0||rate>=cycle_hz)
+  {
+    return 1;
+  }
+  return (unsigned long)((cycle_hz+rate/2)/rate);
+}
+
+/* @scheduleDatatype
+ * @brief Fire datatype delay (>=1) ticks after the current tick
+ */
+inline void scheduleDatatype(TickWheel *wheel,int datatype,unsigned long delay)
+{
+  wheel->slot[(wheel->tick+delay)%WHEEL_SLOTS]|=1u<<datatype;
+  wheel->rounds[datatype]=(unsigned)((delay-1)/WHEEL_SLOTS);
+}
+
+/* @popDueDatatypes
+ * @return Bit mask of datatypes firing on the current tick
+ */
+unsigned popDueDatatypes(TickWheel *wheel)
+{
+  uint8_t &slot=wheel->slot[wheel->tick%WHEEL_SLOTS];
+  unsigned due=0;
+  for(int i=0;i<MAX_DATA_TYPE;i++)
+  {
+    if(!((slot>>i)&1))
+    {
+      continue;
+    }
+    if(wheel->rounds[i]>0)
+    {
+      wheel->rounds[i]--;
+      continue;
+    }
+    slot&=~(1u<<i);
+    due|=1u<<i;
+  }
+  return due;
+}
+
+/* @setTickBudget
+ * @brief Bytes one link may send per tick, API mode links share one UART
+ * @detail Not called by the benchmark, a pty has no baud rate.
+ */
+void setTickBudget(int hz)
+{
+  tick_budget_bytes=hz>0?baud_rate/10/hz:0;        // 8N1 is 10 bits per byte
+  if(xbee_api_mode&&num_links>0)
+  {
+    tick_budget_bytes/=num_links;
+  }
+}
+
+/*
+ * Reliable delivery
+ * With reliable_delivery, calib and kicker (datatype 1 and 2) are queued
+ * with the next SEQ of the datatype. Calib is a setting and is queued once
+ * per change of its value; a kicker command is an event and each one
+ * stored is queued from the kick queue, so kicks with the same command or
+ * within one tick all go out, one new record per tick. A queued record is sent, then retransmitted every RETRANSMIT_MS until the
+ * robot ACKs its SEQ or it went out MAX_TRANSMISSIONS times. Up to
+ * RELIABLE_WINDOW records wait per datatype; each ACK frees its own one,
+ * so only the lost records are resent. At most one record per datatype
+ * goes out per cycle, which bounds the cycle like before. Velocity stays
+ * fire-and-forget.
+ */
+bool reliable_delivery=RELIABLE_DELIVERY;
+
+struct ReliableRecord
+{
+  bool used;
+  uint8_t seq;
+  Payload payload;              // packed with SEQ
+  int64_t queued_ns;
+  int64_t sent_ns;              // 0 until first transmission
+  int transmissions;
+};
+
+struct ReliableChannel
+{
+  uint8_t next_seq;
+  bool has_value;
+  Payload last_value;           // packed without SEQ, last value queued
+  ReliableRecord window[RELIABLE_WINDOW];
+  // statistics
+  unsigned long queued;
+  unsigned long delivered;
+  unsigned long retransmits;
+  unsigned long given_up;
+  unsigned long stale_acks;     // ACK of a SEQ no longer in the window
+  unsigned long window_full;    // cycles a new value waited for the window
+  int64_t ack_ns_sum;           // queued to ACKed
+  int64_t ack_ns_max;
+};
+
+void initReliableChannel(ReliableChannel *ch)
+{
+  ch->next_seq=0;
+  ch->has_value=false;
+  ch->last_value.clear();
+  for(int i=0;i<RELIABLE_WINDOW;i++)
+  {
+    ch->window[i].used=false;
+  }
+  ch->queued=0;
+  ch->delivered=0;
+  ch->retransmits=0;
+  ch->given_up=0;
+  ch->stale_acks=0;
+  ch->window_full=0;
+  ch->ack_ns_sum=0;
+  ch->ack_ns_max=0;
+}
+
+inline bool isReliableDatatype(int datatype)
+{
+  return reliable_delivery&&(datatype==CalibSchema::datatype||datatype==KickerSchema::datatype);
+}
+
+/* @setReliableData
+ * @brief Pack datatype 1 or 2 of cmd with seq into buf
+ */
+void setReliableData(uint8_t datatype,const RobotCommand &cmd,uint8_t seq,Payload *buf)
+{
+  if(datatype==CalibSchema::datatype)
+  {
+    const uint32_t values[]={cmd.calib_data,seq};
+    ReliableCalibSchema::pack(values,buf);
+  }
+  else if(datatype==KickerSchema::datatype)
+  {
+    const uint32_t values[]={cmd.command,seq};
+    ReliableKickerSchema::pack(values,buf);
+  }
+}
+
+/* @registerReliableSizes
+ * @brief Let a decoder of host frames parse datatype 1 and 2 with SEQ
+ */
+void registerReliableSizes(FrameDecoder *dec)
+{
+  if(reliable_delivery)
+  {
+    setDecoderPayloadSize(dec,CalibSchema::datatype,ReliableCalibSchema::payload_size);
+    setDecoderPayloadSize(dec,KickerSchema::datatype,ReliableKickerSchema::payload_size);
+  }
+}
+
+/*
+ * Link quality
+ * Once per QUALITY_WINDOW_MS each link is judged from what the robot sent
+ * back in that window: share of frames with checksum errors or broken
+ * framing (needs QUALITY_MIN_FRAMES), average ACK latency of reliable
+ * delivery and, in API mode, the RSSI the coordinator reports with the DB
+ * command. A congested window doubles the period of backoff_mask
+ * datatypes up to 1<<MAX_BACKOFF, QUALITY_RAMP_WINDOWS clear windows in a
+ * row halve it again. hz is shared by every robot, so the backoff is per
+ * link instead, and velocity is never slowed down.
+ */
+#define MAX_BACKOFF 3
+#define QUALITY_MIN_FRAMES 10
+#define QUALITY_RAMP_WINDOWS 4
+bool adaptive_rate=ADAPTIVE_RATE;
+unsigned backoff_mask=BACKOFF_MASK;
+int quality_error_percent=QUALITY_ERROR_PERCENT;
+int quality_ack_ms=QUALITY_ACK_MS;
+int quality_rssi_dbm=QUALITY_RSSI_DBM;
+
+struct LinkQuality
+{
+  int64_t window_start_ns;
+  unsigned long frames_seen;      // decoder counters at window start
+  unsigned long errors_seen;
+  unsigned long acks_seen;
+  int64_t ack_ns_seen;
+  double error_percent;           // last window, -1 too few frames
+  double ack_ms;                  // last window, -1 no ACK
+  int rssi_dbm;                   // last DB answer, 0 unknown
+  int backoff;                    // period of backoff_mask datatypes is << backoff
+  int clear_windows;
+  unsigned long congested_windows;
+  unsigned long windows;
+};
+
+void initLinkQuality(LinkQuality *q)
+{
+  memset(q,0,sizeof(*q));
+  q->error_percent=-1;
+  q->ack_ms=-1;
+}
+
+/*
+ * Serial link
+ * Everything one serial port needs: fd, transmit buffers and RX decoder.
+ * Each link sends the commands of one robot.
+ */
+struct SerialLink
+{
+  const char *port;
+  int robot;                    // index in robot_command[]
+  int fd;                       // -1 after the port failed
+  int device_fd;                // closed at exit only, so a writer thread never sees it reused
+  int write_timeout_ms;
+  Payload send_buffer;
+  RecordBuffer records;         // MULTI_RECORD: header + payloads of this cycle
+  TxBuffer tx_buffer;
+  FrameDecoder decoder;
+  Payload last_payload[MAX_DATA_TYPE];  // last payload sent per datatype
+  int64_t last_sent_ns[MAX_DATA_TYPE];
+  unsigned long sent[MAX_DATA_TYPE];
+  unsigned long suppressed[MAX_DATA_TYPE];
+  OutputQueueStats outq;
+  TickWheel wheel;
+  unsigned long deferred[MAX_DATA_TYPE];  // moved to the next tick by tick_budget_bytes
+  // frame version negotiation
+  int frame_version;            // FrameVersion used in both directions
+  bool negotiated;              // robot answered hello
+  int64_t last_hello_ns;
+  unsigned long hellos;
+  // VECTOR_DELTA state
+  VectorData vector_ref;        // vector the robot holds after the last frame sent
+  int64_t last_keyframe_ns;
+  unsigned resend_pending;      // bit i forces datatype i out in next cycle (NACK)
+  unsigned long keyframes;
+  unsigned long deltas[2];      // 2 and 3 byte deltas
+  unsigned long nacks;
+  ReliableChannel reliable[MAX_DATA_TYPE];  // used for isReliableDatatype() only
+  LinkQuality quality;
+};
+
+/* @handleAck
+ * @brief Free the record of seq in the window of ch
+ */
+void handleAck(ReliableChannel *ch,uint8_t seq,int64_t now)
+{
+  for(int i=0;i<RELIABLE_WINDOW;i++)
+  {
+    ReliableRecord &rec=ch->window[i];
+    if(rec.used&&rec.seq==seq)
+    {
+      const int64_t latency=now-rec.queued_ns;
+      rec.used=false;
+      ch->delivered++;
+      ch->ack_ns_sum+=latency;
+      if(latency>ch->ack_ns_max)
+      {
+        ch->ack_ns_max=latency;
+      }
+      return;
+    }
+  }
+  ch->stale_acks++;
+}
+
+/* @updateLinkQuality
+ * @brief Close the quality window of link when it is over, adapt the backoff
+ * @detail Called at the start of every tick, costs a compare otherwise.
+ */
+void updateLinkQuality(SerialLink *link,int64_t now)
+{
+  LinkQuality &q=link->quality;
+  const FrameDecoder &dec=link->decoder;
+  if(q.window_start_ns==0)
+  {
+    q.window_start_ns=now;
+  }
+  if(now-q.window_start_ns<(int64_t)QUALITY_WINDOW_MS*1000000LL)
+  {
+    return;
+  }
+  const unsigned long errors=dec.checksum_errors+dec.broken_frames;
+  unsigned long acks=0;
+  int64_t ack_ns=0;
+  for(int i=0;i<MAX_DATA_TYPE;i++)
+  {
+    acks+=link->reliable[i].delivered;
+    ack_ns+=link->reliable[i].ack_ns_sum;
+  }
+  const unsigned long bad=errors-q.errors_seen;
+  const unsigned long total=dec.frames-q.frames_seen+bad;
+  q.error_percent=total>=QUALITY_MIN_FRAMES?100.0*bad/total:-1;
+  q.ack_ms=acks>q.acks_seen?(double)(ack_ns-q.ack_ns_seen)/(acks-q.acks_seen)/1e6:-1;
+  q.frames_seen=dec.frames;
+  q.errors_seen=errors;
+  q.acks_seen=acks;
+  q.ack_ns_seen=ack_ns;
+  q.window_start_ns=now;
+  q.windows++;
+
+  const bool congested=q.error_percent>quality_error_percent
+                       ||q.ack_ms>quality_ack_ms
+                       ||(q.rssi_dbm!=0&&q.rssi_dbm<quality_rssi_dbm);
+  if(congested)
+  {
+    q.congested_windows++;
+    q.clear_windows=0;
+    if(adaptive_rate&&q.backoff<MAX_BACKOFF)
+    {
+      q.backoff++;
+    }
+  }
+  else if(++q.clear_windows>=QUALITY_RAMP_WINDOWS)
+  {
+    q.clear_windows=0;
+    if(q.backoff>0)
+    {
+      q.backoff--;
+    }
+  }
+  if(!adaptive_rate)
+  {
+    q.backoff=0;                    // switched off by SIGHUP
+  }
+}
+
+/* @publishLinkMetrics
+ * @brief Mirror the statistics of link into its metrics block
+ */
+void publishLinkMetrics(const SerialLink *link)
+{
+  LinkMetrics &m=link_metrics[link->robot];
+  for(int i=0;i<MAX_DATA_TYPE;i++)
+  {
+    setMetric(&m.frames[i],link->sent[i]);
+  }
+  addMetric(&m.tx_bytes,link->tx_buffer.size);
+  setMetric(&m.rx_frames,link->decoder.frames);
+  setMetric(&m.checksum_errors,link->decoder.checksum_errors);
+  setMetric(&m.broken_frames,link->decoder.broken_frames);
+  setMetric(&m.outq_bytes,link->outq.last);
+  setMetric(&m.outq_skipped,link->outq.drops);
+  m.error_percent.store(link->quality.error_percent,std::memory_order_relaxed);
+  m.ack_ms.store(link->quality.ack_ms,std::memory_order_relaxed);
+  m.rssi_dbm.store(link->quality.rssi_dbm,std::memory_order_relaxed);
+  m.backoff.store(link->quality.backoff,std::memory_order_relaxed);
+}
+
+/* @setLinkFrameVersion
+ * @brief Switch both directions of link to version
+ */
+void setLinkFrameVersion(SerialLink *link,int version)
+{
+  link->frame_version=version;
+  link->decoder.version=version;
+}
+
+/* @receiveCallback
+ * @brief Called by FrameDecoder for every valid frame from the robot
+ * @detail With frame_version 0 a hello from the robot settles the link on
+ *         the highest version both sides know. A resync request makes
+ *         encodeCycle() send that datatype in the next cycle, an ACK
+ *         frees a record of reliable delivery.
+ */
+unsigned long rx_frame_count[1<<DATATYPE_BITS];
+
+void receiveCallback(const uint8_t *payload,size_t len,void *user)
+{
+  SerialLink *link=(SerialLink*)user;
+  uint32_t values[HelloSchema::field_count];
+  uint8_t type=payload[0]>>(8-DATATYPE_BITS);
+
+  (void)len;
+  rx_frame_count[type]++;
+  TRACE(TRACE_RX,link!=NULL?link->robot:0xFFFF,0,payload,len);
+  if(link!=NULL)
+  {
+    captureFrame(CAPTURE_RX,link->robot,payload,len);
+  }
+  if(type==HelloSchema::datatype&&frame_version==0&&link!=NULL)
+  {
+    HelloSchema::unpack(payload,values);
+    int version=(int)values[0]<MAX_FRAME_VERSION?(int)values[0]:MAX_FRAME_VERSION;
+    setLinkFrameVersion(link,version>=FRAME_V1?version:FRAME_V1);
+    link->negotiated=true;
+  }
+  else if(type==AckSchema::datatype&&link!=NULL)
+  {
+    uint32_t ack[AckSchema::field_count];
+    AckSchema::unpack(payload,ack);
+    if(isReliableDatatype((int)ack[0]))
+    {
+      handleAck(&link->reliable[ack[0]],(uint8_t)ack[2],getMonotonicNs());
+    }
+  }
+  else if(type==NackSchema::datatype&&link!=NULL)
+  {
+    uint32_t nack[NackSchema::field_count];
+    NackSchema::unpack(payload,nack);
+    if(nack[0]<MAX_DATA_TYPE)
+    {
+      link->resend_pending|=1u<<nack[0];
+      link->nacks++;
+    }
+  }
+}
+
+void initSerialLink(SerialLink *link,const char *port,int robot,int fd,int write_timeout_ms)
+{
+  link->port=port;
+  link->robot=robot;
+  link->fd=fd;
+  link->device_fd=fd;
+  link->write_timeout_ms=write_timeout_ms;
+  link->send_buffer.clear();
+  link->records.clear();
+  link->tx_buffer.clear();
+  initFrameDecoder(&link->decoder,receiveCallback,link);
+  setDecoderPayloadSize(&link->decoder,AckSchema::datatype,AckSchema::payload_size);
+  initOutputQueueStats(&link->outq);
+  initTickWheel(&link->wheel);
+  initLinkQuality(&link->quality);
+  setLinkFrameVersion(link,frame_version==0?FRAME_V1:frame_version);
+  link->negotiated=false;
+  link->last_hello_ns=0;
+  link->hellos=0;
+  link->vector_ref.x_vector=0;
+  link->vector_ref.y_vector=0;
+  link->vector_ref.th_vector=0;
+  link->last_keyframe_ns=0;
+  link->resend_pending=0;
+  link->keyframes=0;
+  link->deltas[0]=0;
+  link->deltas[1]=0;
+  link->nacks=0;
+  for(int i=0;i<MAX_DATA_TYPE;i++)
+  {
+    initReliableChannel(&link->reliable[i]);
+    link->last_payload[i].clear();
+    link->last_sent_ns[i]=0;
+    link->sent[i]=0;
+    link->suppressed[i]=0;
+    link->deferred[i]=0;
+  }
+}
+
+/*
+ * Velocity delta encoding
+ * With vector_delta, datatype 0 is sent as the difference to vector_ref,
+ * the vector the robot holds. Deltas within 4 bits go in 2 bytes, within
+ * 7 bits in 3 bytes; anything larger, every DELTA_KEYFRAME_MS and after a
+ * resync request the full 5-byte vector is sent as a keyframe.
+ * vector_ref only moves when a frame is actually sent.
+ */
+bool vector_delta=VECTOR_DELTA;
+
+inline int vectorDelta(uint16_t next,uint16_t ref)
+{
+  return (int)((next-ref+2048)&0xFFF)-2048;     // 12-bit wrap-around
+}
+
+inline bool fitsSigned(int value,unsigned bits)
+{
+  return -(1<<(bits-1))<=value&&value<(1<<(bits-1));
+}
+
+/* @setVectorDeltaData
+ * @brief Pack cmd.vector into buf as keyframe or delta frame against link
+ * @return true if buf holds a keyframe
+ */
+bool setVectorDeltaData(const SerialLink *link,const RobotCommand &cmd,int64_t now,Payload *buf)
+{
+  const int dx=vectorDelta(cmd.vector.x_vector,link->vector_ref.x_vector);
+  const int dy=vectorDelta(cmd.vector.y_vector,link->vector_ref.y_vector);
+  const int dth=vectorDelta(cmd.vector.th_vector,link->vector_ref.th_vector);
+
+  if(link->keyframes==0||(link->resend_pending&(1u<<VectorSchema::datatype))||
+     now-link->last_keyframe_ns>=(int64_t)DELTA_KEYFRAME_MS*1000000LL)
+  {
+    setSendDataFromROSBus(VectorSchema::datatype,cmd,buf);
+    return true;
+  }
+  if(fitsSigned(dx,4)&&fitsSigned(dy,4)&&fitsSigned(dth,4))
+  {
+    const uint32_t values[]={(uint32_t)dx,(uint32_t)dy,(uint32_t)dth,0};
+    VectorDelta2Schema::pack(values,buf);
+    return false;
+  }
+  if(fitsSigned(dx,7)&&fitsSigned(dy,7)&&fitsSigned(dth,7))
+  {
+    const uint32_t values[]={(uint32_t)dx,(uint32_t)dy,(uint32_t)dth};
+    VectorDelta3Schema::pack(values,buf);
+    return false;
+  }
+  setSendDataFromROSBus(VectorSchema::datatype,cmd,buf);
+  return true;
+}
+
+/* @shouldSendDatatype
+ * @brief Decide whether send_buffer of datatype goes out in this cycle
+ * @detail Nothing is suppressed unless send_only_changed is set.
+ */
+bool shouldSendDatatype(const SerialLink *link,int datatype,int64_t now)
+{
+  const Payload &last=link->last_payload[datatype];
+  const Payload &next=link->send_buffer;
+  int keepalive=keepalive_ms[datatype];
+
+  if(!send_only_changed||keepalive==0||link->sent[datatype]==0||((link->resend_pending>>datatype)&1))
+  {
+    return true;
+  }
+  if(last.size!=next.size||memcmp(last.data,next.data,next.size)!=0)
+  {
+    return true;
+  }
+  return keepalive>0&&now-link->last_sent_ns[datatype]>=(int64_t)keepalive*1000000LL;
+}
+
+void printLinkStatistics(const SerialLink *link)
+{
+  printf("%s (robot %d), frame version %d%s\n",link->port,link->robot,link->frame_version,
+         frame_version!=0?"":link->negotiated?" (negotiated)":" (no hello answer)");
+  for(int i=0;i<MAX_DATA_TYPE;i++)
+  {
+    printf("  datatype %d: sent %lu, suppressed %lu, deferred %lu\n",i,link->sent[i],link->suppressed[i],link->deferred[i]);
+  }
+  if(vector_delta)
+  {
+    printf("  vector: keyframes %lu, 2-byte deltas %lu, 3-byte deltas %lu\n",
+           link->keyframes,link->deltas[0],link->deltas[1]);
+  }
+  for(int i=0;i<MAX_DATA_TYPE;i++)
+  {
+    const ReliableChannel &ch=link->reliable[i];
+    if(!isReliableDatatype(i))
+    {
+      continue;
+    }
+    printf("  reliable datatype %d: queued %lu, delivered %lu, retransmits %lu, given up %lu, stale ACK %lu, window full %lu\n",
+           i,ch.queued,ch.delivered,ch.retransmits,ch.given_up,ch.stale_acks,ch.window_full);
+    printf("    ACK latency avg %.2f, max %.2f [ms]\n",
+           ch.delivered>0?(double)ch.ack_ns_sum/ch.delivered/1e6:0.0,ch.ack_ns_max/1e6);
+    if(i==KickerSchema::datatype)
+    {
+      printf("    kick queue full %lu\n",robot_command[link->robot].kicks.dropped.load());
+    }
+  }
+  printf("  resync requests %lu\n",link->nacks);
+  if(shm_area!=NULL)
+  {
+    printf("  shm commands %lu, producer dropped %lu, max age %.1f[us]\n",shm_commands[link->robot],
+           (unsigned long)shm_area->ring[link->robot].dropped.load(),shm_age_max[link->robot]/1000.0);
+  }
+  printf("  link quality: errors %.1f%%, ACK latency %.2f[ms], RSSI %d[dBm], congested %lu/%lu windows, backoff %d\n",
+         link->quality.error_percent,link->quality.ack_ms,link->quality.rssi_dbm,
+         link->quality.congested_windows,link->quality.windows,link->quality.backoff);
+  printOutputQueueStats(&link->outq);
+}
+
+/* @appendRecord
+ * @brief Escape and checksum payload into transmit buffer, or collect it
+ *        for one multi-record frame
+ */
+void appendRecord(SerialLink *link,const Payload &payload)
+{
+  if(multi_record)
+  {
+    memcpy(link->records.data+link->records.size,payload.data,payload.size);
+    link->records.size+=payload.size;
+    link->records.data[0]++;
+  }
+  else
+  {
+    encodeFrame(payload,&link->tx_buffer,link->frame_version);
+  }
+}
+
+/* @collectReliable
+ * @brief Queue a new value of datatype and send at most one due record
+ * @param[in] value Packed without SEQ by setSendDataFromROSBus(), unused
+ *            for the kicker, whose kicks come from the kick queue
+ * @param[in] sample The datatype fired on this tick, value may be queued.
+ *            Retransmits run on every tick.
+ */
+void collectReliable(SerialLink *link,int datatype,const RobotCommand &cmd,const Payload &value,int64_t now,bool sample)
+{
+  ReliableChannel &ch=link->reliable[datatype];
+  ReliableRecord *due=NULL;
+  const int64_t timeout=(int64_t)RETRANSMIT_MS*1000000LL;
+  KickQueue &kicks=robot_command[link->robot].kicks;
+
+  const bool fresh=datatype==KickerSchema::datatype?!kicks.empty()
+                  :!ch.has_value||value.size!=ch.last_value.size||memcmp(value.data,ch.last_value.data,value.size)!=0;
+  if(sample&&fresh)
+  {
+    ReliableRecord *slot=NULL;
+    for(int i=0;i<RELIABLE_WINDOW&&slot==NULL;i++)
+    {
+      slot=ch.window[i].used?NULL:&ch.window[i];
+    }
+    if(slot!=NULL)
+    {
+      slot->used=true;
+      slot->seq=ch.next_seq++;
+      slot->payload.clear();
+      RobotCommand queued=cmd;
+      if(datatype==KickerSchema::datatype)
+      {
+        queued.command=kicks.pop();
+      }
+      setReliableData((uint8_t)datatype,queued,slot->seq,&slot->payload);
+      slot->queued_ns=now;
+      slot->sent_ns=0;
+      slot->transmissions=0;
+      ch.last_value=value;
+      ch.has_value=true;
+      ch.queued++;
+    }
+    else
+    {
+      ch.window_full++;         // retried next cycle, the value or kick still waits
+    }
+  }
+
+  // a resync request makes every record due now
+  const bool resync=(link->resend_pending>>datatype)&1;
+  link->resend_pending&=~(1u<<datatype);
+  for(int i=0;i<RELIABLE_WINDOW;i++)
+  {
+    ReliableRecord &rec=ch.window[i];
+    if(!rec.used||(rec.sent_ns!=0&&!resync&&now-rec.sent_ns<timeout))
+    {
+      continue;
+    }
+    if(rec.transmissions>=MAX_TRANSMISSIONS)
+    {
+      rec.used=false;
+      ch.given_up++;
+      continue;
+    }
+  // oldest first, it has waited longest
+    if(due==NULL||(int8_t)(rec.seq-due->seq)<0)
+    {
+      due=&rec;
+    }
+  }
+  if(due==NULL)
+  {
+    link->suppressed[datatype]+=sample?1:0;
+    return;
+  }
+  if(due->transmissions>0)
+  {
+    ch.retransmits++;
+  }
+  appendRecord(link,due->payload);
+  due->sent_ns=now;
+  due->transmissions++;
+  link->last_sent_ns[datatype]=now;
+  link->sent[datatype]++;
+}
+
+/* @isOverTickBudget
+ * @brief Would a record of payload_size bytes exceed the credit of the link
+ * @detail Counts escaping as worst case, the real size is charged at the
+ *         end of the tick.
+ */
+bool isOverTickBudget(const SerialLink *link,size_t payload_size)
+{
+  const size_t framing=1+2*MAX_CHECK_SIZE;
+  size_t used=link->tx_buffer.size;
+  if(tick_budget_bytes<=0)
+  {
+    return false;
+  }
+  if(multi_record&&link->records.data[0]>0)
+  {
+    used+=framing+2*link->records.size;         // header byte and records
+  }
+  return (long)(used+2*payload_size+(multi_record&&link->records.data[0]>0?0:framing))>(long)link->wheel.credit;
+}
+
+/* @encodeCycle
+ * @brief Encode every datatype firing on this tick into link->tx_buffer
+ */
+void encodeCycle(SerialLink *link)
+{
+  int64_t start=getMonotonicNs();
+  updateLinkQuality(link,start);
+  pollCommandSource(link->robot,start);
+  // get sending data from ROS bus
+  const RobotCommand cmd=loadRobotCommand(robot_command[link->robot]);
+
+  link->tx_buffer.clear();
+  if(tick_budget_bytes>0)
+  {
+    const int cap=2*(tick_budget_bytes>(int)MAX_FRAME_SIZE?tick_budget_bytes:(int)MAX_FRAME_SIZE);
+    link->wheel.credit=link->wheel.credit+tick_budget_bytes<cap?link->wheel.credit+tick_budget_bytes:cap;
+  }
+  if(frame_version==0&&!link->negotiated&&
+     (link->hellos==0||start-link->last_hello_ns>=(int64_t)HELLO_INTERVAL_MS*1000000LL))
+  {
+  // offer the highest frame version, old firmware drops the unknown datatype
+    const uint32_t values[]={(uint32_t)MAX_FRAME_VERSION};
+    HelloSchema::pack(values,&link->send_buffer);
+    encodeFrame(link->send_buffer,&link->tx_buffer,FRAME_V1);
+    link->send_buffer.clear();
+    link->last_hello_ns=start;
+    link->hellos++;
+  }
+  link->records.clear();
+  link->records.push_back(0);           // multi-record header, count is set below
+  const unsigned due=popDueDatatypes(&link->wheel);
+  unsigned deferred=0;
+  int order[MAX_DATA_TYPE];
+  int count=0;
+  for(int pass=0;pass<2;pass++)
+  {
+    for(int i=0;i<MAX_DATA_TYPE;i++)
+    {
+      if(((link->wheel.late>>i)&1)==(pass==0?1u:0u))
+      {
+        order[count++]=i;           // deferred last tick first, then by datatype
+      }
+    }
+  }
+  for(int k=0;k<MAX_DATA_TYPE;k++)
+  {
+    const int i=order[k];
+    const bool fired=(due>>i)&1;
+    if(!((datatype_mask>>i)&1)||(!fired&&!isReliableDatatype(i)))
+    {
+      continue;
+    }
+  // make sending byte-data buffer from integer-data
+    bool keyframe=false;
+    if(isReliableDatatype(i))
+    {
+      setSendDataFromROSBus((uint8_t)i,cmd,&link->send_buffer);
+      if(deferred==0&&!isOverTickBudget(link,link->send_buffer.size+1))
+      {
+        collectReliable(link,i,cmd,link->send_buffer,start,fired);
+      }
+      else if(fired)
+      {
+        deferred|=1u<<i;
+      }
+      link->send_buffer.clear();
+      continue;
+    }
+    if(vector_delta&&i==VectorSchema::datatype)
+    {
+      keyframe=setVectorDeltaData(link,cmd,start,&link->send_buffer);
+    }
+    else
+    {
+      setSendDataFromROSBus((uint8_t)i,cmd,&link->send_buffer);
+    }
+
+    if(deferred!=0||isOverTickBudget(link,link->send_buffer.size))
+    {
+      deferred|=1u<<i;      // keeps the order, a later one can't overtake
+    }
+    else if(shouldSendDatatype(link,i,start))
+    {
+    // escape and checksum into transmit buffer, or collect for one multi-record frame
+      appendRecord(link,link->send_buffer);
+      if(vector_delta&&i==VectorSchema::datatype)
+      {
+        link->vector_ref=cmd.vector;
+        if(keyframe)
+        {
+          link->last_keyframe_ns=start;
+          link->keyframes++;
+        }
+        else
+        {
+          link->deltas[link->send_buffer.size==VectorDelta2Schema::payload_size?0:1]++;
+        }
+      }
+      link->resend_pending&=~(1u<<i);
+      link->last_payload[i]=link->send_buffer;
+      link->last_sent_ns[i]=start;
+      link->sent[i]++;
+    }
+    else
+    {
+      link->suppressed[i]++;
+    }
+
+    link->send_buffer.clear();
+  }
+  // next tick for what didn't fit, next period for the rest
+  for(int i=0;i<MAX_DATA_TYPE;i++)
+  {
+    if((deferred>>i)&1)
+    {
+      scheduleDatatype(&link->wheel,i,1);
+      link->deferred[i]++;
+    }
+    else if((due>>i)&1)
+    {
+      scheduleDatatype(&link->wheel,i,periodTicks(i)<<((backoff_mask>>i)&1?link->quality.backoff:0));
+    }
+  }
+  link->wheel.late=deferred;
+  // a single record goes out as a plain frame, it saves the header byte
+  if(link->records.data[0]==1)
+  {
+    link->tx_buffer.size+=encodeFrame(link->records.data+1,link->records.size-1,
+                                      link->tx_buffer.data+link->tx_buffer.size,link->frame_version);
+  }
+  else if(link->records.data[0]>1)
+  {
+    link->records.data[0]|=MultiRecordSchema::datatype<<(8-DATATYPE_BITS);
+    link->tx_buffer.size+=encodeFrame(link->records.data,link->records.size,
+                                      link->tx_buffer.data+link->tx_buffer.size,link->frame_version);
+  }
+  if(tick_budget_bytes>0)
+  {
+    link->wheel.credit-=(int)link->tx_buffer.size;
+  }
+  link->wheel.tick++;
+  TRACE(TRACE_TX,link->robot,0,link->tx_buffer.data,link->tx_buffer.size);
+  if(!xbee_api_mode)
+  {
+    captureFrame(CAPTURE_TX,link->robot,link->tx_buffer.data,link->tx_buffer.size);
+  }
+  publishLinkMetrics(link);
+
+  recordHistogram(&cycle_histogram[HIST_ENCODE],getMonotonicNs()-start);
+}
+
+/* @resendAfterFlush
+ * @brief The frames of link queued before tcflush() never reached the robot
+ * @detail Every datatype goes out in the next cycle as after a resync
+ *         request: change-driven TX would count the flushed value as
+ *         delivered, and vector_ref already moved to the flushed vector, so
+ *         the next velocity must be a keyframe.
+ */
+void resendAfterFlush(SerialLink *link)
+{
+  link->resend_pending|=(1u<<MAX_DATA_TYPE)-1;
+}
+
+/* @transmitCycle
+ * @brief Encode every datatype and send them with one write()
+ * @return 0 on success, -1 on write error (errno is set)
+ */
+int transmitCycle(SerialLink *link)
+{
+  int64_t encode_end=0;
+  int ret=0;
+
+  const int outq=checkOutputQueue(link->fd,&link->outq);
+  if(outq==OUTQ_SKIP)
+  {
+    return 0;
+  }
+  if(outq==OUTQ_FLUSHED)
+  {
+    resendAfterFlush(link);
+  }
+  encodeCycle(link);
+  encode_end=getMonotonicNs();
+
+  // send all frames of this cycle with one write()
+  ret=writeAll(link->fd,link->tx_buffer.data,link->tx_buffer.size,link->write_timeout_ms);
+  const int64_t write_ns=getMonotonicNs()-encode_end;
+  recordHistogram(&cycle_histogram[HIST_WRITE],write_ns);
+  recordMetric(&loop_thread_metrics.write_latency,write_ns);
+  addMetric(&loop_thread_metrics.write_errors,ret<0);
+  TRACE(TRACE_WRITE,link->robot,ret<0?0:(uint32_t)link->tx_buffer.size,NULL,0);
+  debug("writeAll end");
+  return ret;
+}
+
+/*
+ * XBee API mode (AP=2)
+ * One coordinator XBee serves the whole team. Each robot's frames become
+ * the RF data of a TX Request (0x10) to its 64-bit address, or with
+ * xbee_broadcast several robots are packed into one broadcast TX Request,
+ * each preceded by a robot select frame (datatype 3). All API frames of a
+ * cycle go out with one write(). TX Status (0x8B) is counted, and RF data
+ * of RX Packets (0x90) goes to the FrameDecoder of the sending robot.
+ * With adaptive_rate a local AT command DB (0x08) asks once per quality
+ * window for the RSSI of the last received packet, the AT Command
+ * Response (0x88) is credited to the robot that sent that packet.
+ */
+const uint8_t API_START_BYTE=0x7E;
+const uint8_t API_ESCAPE_BYTE=0x7D;
+const uint8_t API_XON=0x11;
+const uint8_t API_XOFF=0x13;
+const uint8_t API_TX_REQUEST=0x10;
+const uint8_t API_TX_STATUS=0x8B;
+const uint8_t API_RX_PACKET=0x90;
+const uint8_t API_AT_COMMAND=0x08;
+const uint8_t API_AT_RESPONSE=0x88;
+constexpr size_t API_TX_HEADER_SIZE=14;       // type, id, addr64, addr16, radius, options
+constexpr size_t API_MAX_FRAME_DATA=API_TX_HEADER_SIZE+XBEE_MAX_RF_DATA;
+constexpr size_t API_MAX_FRAME_SIZE=1+2*(2+API_MAX_FRAME_DATA+1);  // start + escaped length, data, checksum
+constexpr size_t API_MAX_FRAMES=2*MAX_LINKS;  // a robot may straddle two broadcast packets
+static_assert(TX_BUFFER_SIZE+MAX_FRAME_SIZE<=XBEE_MAX_RF_DATA,"one robot must fit in one TX Request");
+
+typedef ByteBuffer<API_MAX_FRAME_SIZE*API_MAX_FRAMES> ApiTxBuffer;
+typedef ByteBuffer<XBEE_MAX_RF_DATA> RfData;
+
+struct ApiPort
+{
+  int fd;
+  int write_timeout_ms;
+  uint8_t frame_id;             // 1-255, 0 would suppress TX Status
+  ApiTxBuffer tx_buffer;
+  RfData rf_data;
+  // receive state
+  int state;
+  bool escaped;
+  size_t length;
+  uint8_t checksum;
+  ByteBuffer<256> frame;
+  // statistics
+  unsigned long tx_requests;
+  unsigned long tx_status_ok;
+  unsigned long tx_status_fail;
+  unsigned long rx_packets;
+  unsigned long rx_unknown_source;
+  unsigned long checksum_errors;
+  // RSSI polling
+  int last_rx_link;             // robot of the last RX Packet, -1 none
+  int rssi_link;                // robot the pending DB query is for
+  uint8_t rssi_frame_id;
+  int64_t last_rssi_query_ns;
+  unsigned long rssi_queries;
+  unsigned long rssi_answers;
+  OutputQueueStats outq;
+};
+
+enum ApiDecoderState
+{
+  API_WAIT_START,
+  API_LENGTH_MSB,
+  API_LENGTH_LSB,
+  API_FRAME_DATA,
+  API_CHECKSUM
+};
+
+void initApiPort(ApiPort *api,int fd,int write_timeout_ms)
+{
+  api->fd=fd;
+  api->write_timeout_ms=write_timeout_ms;
+  api->frame_id=1;
+  api->tx_buffer.clear();
+  api->rf_data.clear();
+  api->state=API_WAIT_START;
+  api->escaped=false;
+  api->length=0;
+  api->checksum=0;
+  api->frame.clear();
+  api->tx_requests=0;
+  api->tx_status_ok=0;
+  api->tx_status_fail=0;
+  api->rx_packets=0;
+  api->rx_unknown_source=0;
+  api->checksum_errors=0;
+  api->last_rx_link=-1;
+  api->rssi_link=-1;
+  api->rssi_frame_id=0;
+  api->last_rssi_query_ns=0;
+  api->rssi_queries=0;
+  api->rssi_answers=0;
+  initOutputQueueStats(&api->outq);
+}
+
+inline bool isApiSpecialByte(uint8_t byte)
+{
+  return byte==API_START_BYTE||byte==API_ESCAPE_BYTE||byte==API_XON||byte==API_XOFF;
+}
+
+inline void putApiByte(ApiTxBuffer *out,uint8_t byte)
+{
+  if(isApiSpecialByte(byte))
+  {
+    out->push_back(API_ESCAPE_BYTE);
+    byte^=0x20;
+  }
+  out->push_back(byte);
+}
+
+/* @appendTxRequest
+ * @brief Append one escaped TX Request API frame carrying rf to out
+ */
+void appendTxRequest(ApiPort *api,uint64_t address,const RfData &rf)
+{
+  const size_t length=API_TX_HEADER_SIZE+rf.size;
+  uint8_t header[API_TX_HEADER_SIZE];
+  uint8_t sum=0;
+  size_t n=0;
+
+  header[n++]=API_TX_REQUEST;
+  header[n++]=api->frame_id;
+  for(int shift=56;shift>=0;shift-=8)
+  {
+    header[n++]=(uint8_t)(address>>shift);
+  }
+  header[n++]=0xFF;             // 16-bit address unknown
+  header[n++]=0xFE;
+  header[n++]=0x00;             // maximum broadcast radius
+  header[n++]=0x00;             // default options
+
+  api->tx_buffer.push_back(API_START_BYTE);
+  putApiByte(&api->tx_buffer,(uint8_t)(length>>8));
+  putApiByte(&api->tx_buffer,(uint8_t)(length&0xFF));
+  for(size_t i=0;i<n;i++)
+  {
+    putApiByte(&api->tx_buffer,header[i]);
+    sum+=header[i];
+  }
+  for(size_t i=0;i<rf.size;i++)
+  {
+    putApiByte(&api->tx_buffer,rf.data[i]);
+    sum+=rf.data[i];
+  }
+  putApiByte(&api->tx_buffer,0xFF-sum);
+
+  api->frame_id=api->frame_id==0xFF?1:api->frame_id+1;
+  api->tx_requests++;
+}
+
+/* @appendAtCommand
+ * @brief Append a local AT command without parameter, e.g. "DB"
+ * @return frame id the response will carry
+ */
+uint8_t appendAtCommand(ApiPort *api,const char command[2])
+{
+  const uint8_t data[]={API_AT_COMMAND,api->frame_id,(uint8_t)command[0],(uint8_t)command[1]};
+  const uint8_t id=api->frame_id;
+  uint8_t sum=0;
+
+  api->tx_buffer.push_back(API_START_BYTE);
+  putApiByte(&api->tx_buffer,0);
+  putApiByte(&api->tx_buffer,(uint8_t)sizeof(data));
+  for(size_t i=0;i<sizeof(data);i++)
+  {
+    putApiByte(&api->tx_buffer,data[i]);
+    sum+=data[i];
+  }
+  putApiByte(&api->tx_buffer,0xFF-sum);
+  api->frame_id=api->frame_id==0xFF?1:api->frame_id+1;
+  return id;
+}
+
+/* @encodeApiCycle
+ * @brief Encode every robot into TX Requests in api->tx_buffer
+ */
+void encodeApiCycle(ApiPort *api,SerialLink *links,int count)
+{
+  Payload select;
+  uint8_t select_frame[MAX_FRAME_SIZE];
+  size_t select_size=0;
+
+  api->tx_buffer.clear();
+  api->rf_data.clear();
+  for(int i=0;i<count;i++)
+  {
+    encodeCycle(&links[i]);
+    const TxBuffer &frames=links[i].tx_buffer;
+    if(frames.size==0)
+    {
+      continue;
+    }
+    if(!xbee_broadcast)
+    {
+      memcpy(api->rf_data.data,frames.data,frames.size);
+      api->rf_data.size=frames.size;
+      appendTxRequest(api,robot_address[i],api->rf_data);
+      api->rf_data.clear();
+      continue;
+    }
+  // robot select frame, then frames of the robot
+    const uint32_t values[]={(uint32_t)links[i].robot};
+    select.clear();
+    RobotSelectSchema::pack(values,&select);
+    select_size=encodeFrame(select,select_frame,FRAME_V1);   // parsed by every robot
+    if(api->rf_data.size+select_size+frames.size>RfData::capacity())
+    {
+      appendTxRequest(api,XBEE_BROADCAST_ADDRESS,api->rf_data);
+      api->rf_data.clear();
+    }
+    memcpy(api->rf_data.data+api->rf_data.size,select_frame,select_size);
+    api->rf_data.size+=select_size;
+    memcpy(api->rf_data.data+api->rf_data.size,frames.data,frames.size);
+    api->rf_data.size+=frames.size;
+  }
+  if(api->rf_data.size>0)
+  {
+    appendTxRequest(api,XBEE_BROADCAST_ADDRESS,api->rf_data);
+  }
+  const int64_t now=getMonotonicNs();
+  if(adaptive_rate&&api->last_rx_link>=0
+     &&now-api->last_rssi_query_ns>=(int64_t)QUALITY_WINDOW_MS*1000000LL)
+  {
+    api->rssi_frame_id=appendAtCommand(api,"DB");
+    api->rssi_link=api->last_rx_link;
+    api->last_rssi_query_ns=now;
+    api->rssi_queries++;
+  }
+  captureFrame(CAPTURE_TX,0,api->tx_buffer.data,api->tx_buffer.size);   // coordinator port
+  setMetric(&loop_metrics.api_outq_bytes,api->outq.last);
+}
+
+/* @transmitApiCycle
+ * @brief Encode every robot and send all TX Requests with one write()
+ * @return 0 on success, -1 on write error (errno is set)
+ */
+int transmitApiCycle(ApiPort *api,SerialLink *links,int count)
+{
+  int64_t encode_end=0;
+  int ret=0;
+
+  const int outq=checkOutputQueue(api->fd,&api->outq);
+  if(outq==OUTQ_SKIP)
+  {
+    return 0;
+  }
+  for(int i=0;i<count&&outq==OUTQ_FLUSHED;i++)
+  {
+    resendAfterFlush(&links[i]);      // every robot shares the coordinator
+  }
+  encodeApiCycle(api,links,count);
+  encode_end=getMonotonicNs();
+
+  ret=writeAll(api->fd,api->tx_buffer.data,api->tx_buffer.size,api->write_timeout_ms);
+  const int64_t write_ns=getMonotonicNs()-encode_end;
+  recordHistogram(&cycle_histogram[HIST_WRITE],write_ns);
+  recordMetric(&loop_thread_metrics.write_latency,write_ns);
+  addMetric(&loop_thread_metrics.write_errors,ret<0);
+  return ret;
+}
+
+/* @handleApiFrame
+ * @brief Dispatch one received API frame whose checksum matched
+ */
+void handleApiFrame(ApiPort *api,SerialLink *links,int count)
+{
+  const uint8_t *data=api->frame.data;
+  const size_t size=api->frame.size;
+  uint64_t source=0;
+
+  if(size>=7&&data[0]==API_TX_STATUS)
+  {
+  // type, id, addr16(2), retry count, delivery status, discovery status
+    if(data[5]==0x00)
+    {
+      api->tx_status_ok++;
+    }
+    else
+    {
+      api->tx_status_fail++;
+    }
+  }
+  else if(size>=12&&data[0]==API_RX_PACKET)
+  {
+  // type, addr64(8), addr16(2), options, RF data
+    api->rx_packets++;
+    for(int i=1;i<=8;i++)
+    {
+      source=(source<<8)|data[i];
+    }
+    for(int i=0;i<count;i++)
+    {
+      if(robot_address[i]==source)
+      {
+        api->last_rx_link=i;
+        feedFrameDecoder(&links[i].decoder,data+12,size-12);
+        return;
+      }
+    }
+    api->rx_unknown_source++;
+  }
+  else if(size>=6&&data[0]==API_AT_RESPONSE&&data[1]==api->rssi_frame_id
+          &&data[2]=='D'&&data[3]=='B'&&data[4]==0x00&&api->rssi_link>=0&&api->rssi_link<count)
+  {
+  // type, id, command(2), status, -RSSI [dBm]
+    links[api->rssi_link].quality.rssi_dbm=-(int)data[5];
+    api->rssi_answers++;
+    api->rssi_link=-1;
+  }
+}
+
+/* @feedApiDecoder
+ * @brief Parse AP=2 escaped API frames from a chunk of received bytes
+ * @detail API_START_BYTE is always escaped inside a frame, so a raw one
+ *         restarts the parser.
+ */
+void feedApiDecoder(ApiPort *api,SerialLink *links,int count,const uint8_t *buf,size_t len)
+{
+  uint8_t byte=0;
+
+  for(size_t i=0;i<len;i++)
+  {
+    byte=buf[i];
+    if(byte==API_START_BYTE)
+    {
+      api->state=API_LENGTH_MSB;
+      api->escaped=false;
+      continue;
+    }
+    if(api->state==API_WAIT_START)
+    {
+      continue;
+    }
+    if(byte==API_ESCAPE_BYTE)
+    {
+      api->escaped=true;
+      continue;
+    }
+    if(api->escaped)
+    {
+      byte^=0x20;
+      api->escaped=false;
+    }
+    switch(api->state)
+    {
+      case API_LENGTH_MSB:
+        api->length=(size_t)byte<<8;
+        api->state=API_LENGTH_LSB;
+        break;
+      case API_LENGTH_LSB:
+        api->length|=byte;
+        api->frame.clear();
+        api->checksum=0;
+        api->state=(api->length==0||api->length>api->frame.capacity())?API_WAIT_START:API_FRAME_DATA;
+        break;
+      case API_FRAME_DATA:
+        api->frame.push_back(byte);
+        api->checksum+=byte;
+        if(api->frame.size==api->length)
+        {
+          api->state=API_CHECKSUM;
+        }
+        break;
+      case API_CHECKSUM:
+        if((uint8_t)(api->checksum+byte)==0xFF)
+        {
+          handleApiFrame(api,links,count);
+        }
+        else
+        {
+          api->checksum_errors++;
+        }
+        api->state=API_WAIT_START;
+        break;
+      default:
+        api->state=API_WAIT_START;
+        break;
+    }
+  }
+}
+
+/* @readApiAvailable
+ * @brief Read everything already received by the coordinator
+ * @return 0 on success, -1 on error or end of file (errno is set)
+ */
+int readApiAvailable(ApiPort *api,SerialLink *links,int count)
+{
+  uint8_t buf[256];
+  ssize_t ret=0;
+
+  while(true)
+  {
+    ret=read(api->fd,buf,sizeof(buf));
+    if(ret>0)
+    {
+      feedApiDecoder(api,links,count,buf,ret);
+      continue;
+    }
+    if(ret<0&&errno==EINTR)
+    {
+      continue;
+    }
+    if(ret<0&&(errno==EAGAIN||errno==EWOULDBLOCK))
+    {
+      return 0;
+    }
+    if(ret==0)
+    {
+      errno=EPIPE;
+    }
+    return -1;
+  }
+}
+
+void printApiStatistics(const ApiPort *api)
+{
+  printf("api tx request %lu, tx status ok %lu, fail %lu, rx packet %lu, unknown source %lu, checksum error %lu\n",
+         api->tx_requests,api->tx_status_ok,api->tx_status_fail,
+         api->rx_packets,api->rx_unknown_source,api->checksum_errors);
+  if(api->rssi_queries>0)
+  {
+    printf("api RSSI queries %lu, answers %lu\n",api->rssi_queries,api->rssi_answers);
+  }
+  printOutputQueueStats(&api->outq);
+}
+
+/*
+ * Pipeline mode
+ * The event loop thread encodes a cycle into a slot and hands it to the
+ * writer thread, which drains it while the loop encodes the next one.
+ * Slots form a single-producer/single-consumer ring indexed by atomic
+ * head/tail; the writer sleeps on an eventfd between cycles. If the
+ * writer is still busy with every slot, the new cycle is dropped rather
+ * than queued, so only fresh commands go out. Write errors are passed
+ * back through write_error[] and handled by the loop thread.
+ */
+#define PIPELINE_DEPTH 2
+
+struct CycleBatch
+{
+  int count;
+  int fd[MAX_LINKS];            // -1 for a failed link
+  TxBuffer frames[MAX_LINKS];
+  int api_fd;                   // coordinator fd in xbee_api_mode, otherwise -1
+  ApiTxBuffer api_frames;
+};
+
+struct Pipeline
+{
+  CycleBatch slots[PIPELINE_DEPTH];
+  std::atomic<unsigned> head;             // next slot the encoder fills
+  std::atomic<unsigned> tail;             // next slot the writer drains
+  std::atomic<bool> stop;
+  std::atomic<int> write_error[MAX_LINKS];  // errno of failed write, 0 if none
+  int event_fd;
+  int write_timeout_ms;
+  pthread_t writer;
+  unsigned long dropped;                  // cycles dropped because writer was behind
+  LatencyHistogram write_histogram;       // writer thread only, merged by stopPipeline()
+};
+Pipeline pipeline;
+
+/* @applyThreadSettings
+ * @brief Pin calling thread to cpu and optionally switch it to SCHED_FIFO
+ * @param[in] cpu Core number, -1 leaves affinity unchanged
+ * @param[in] fifo_priority 1-99 for SCHED_FIFO, 0 keeps current policy
+ */
+void applyThreadSettings(const char *name,int cpu,int fifo_priority)
+{
+  cpu_set_t set;
+  struct sched_param param;
+  int ret=0;
+
+  if(cpu>=0)
+  {
+    CPU_ZERO(&set);
+    CPU_SET(cpu,&set);
+    ret=pthread_setaffinity_np(pthread_self(),sizeof(set),&set);
+    if(ret!=0)
+    {
+      fprintf(stderr,"[%s] %s:%u # %s: can't pin to cpu %d: %s\n",__DATE__,__FILE__,__LINE__,name,cpu,strerror(ret));
+    }
+  }
+  if(fifo_priority>0)
+  {
+    param.sched_priority=fifo_priority;
+    ret=pthread_setschedparam(pthread_self(),SCHED_FIFO,&param);
+    if(ret!=0)
+    {
+      fprintf(stderr,"[%s] %s:%u # %s: can't set SCHED_FIFO: %s\n",__DATE__,__FILE__,__LINE__,name,strerror(ret));
+    }
+  }
+}
+
+void *writerThread(void *arg)
+{
+  Pipeline *pl=(Pipeline*)arg;
+  uint64_t count=0;
+  unsigned t=0;
+  int64_t start=0;
+
+  applyThreadSettings("writer",writer_cpu,writer_sched_fifo);
+  while(true)
+  {
+    t=pl->tail.load(std::memory_order_relaxed);
+    if(t==pl->head.load(std::memory_order_acquire))
+    {
+      if(pl->stop.load(std::memory_order_acquire))
+      {
+        break;
+      }
+      if(read(pl->event_fd,&count,sizeof(count))<0&&errno!=EINTR)
+      {
+        break;
+      }
+      continue;
+    }
+
+    const CycleBatch &batch=pl->slots[t%PIPELINE_DEPTH];
+    start=getMonotonicNs();
+    if(batch.api_fd>=0)
+    {
+      if(writeAll(batch.api_fd,batch.api_frames.data,batch.api_frames.size,pl->write_timeout_ms)<0)
+      {
+        pl->write_error[0].store(errno,std::memory_order_release);
+        addMetric(&writer_thread_metrics.write_errors,1);
+      }
+    }
+    else for(int i=0;i<batch.count;i++)
+    {
+      if(batch.fd[i]>=0&&pl->write_error[i].load(std::memory_order_relaxed)==0
+         &&writeAll(batch.fd[i],batch.frames[i].data,batch.frames[i].size,pl->write_timeout_ms)<0)
+      {
+        pl->write_error[i].store(errno,std::memory_order_release);
+        addMetric(&writer_thread_metrics.write_errors,1);
+      }
+    }
+    const int64_t write_ns=getMonotonicNs()-start;
+    recordHistogram(&pl->write_histogram,write_ns);
+    recordMetric(&writer_thread_metrics.write_latency,write_ns);
+    pl->tail.store(t+1,std::memory_order_release);
+  }
+  return NULL;
+}
+
+/* @startPipeline
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int startPipeline(Pipeline *pl,int write_timeout_ms)
+{
+  int ret=0;
+
+  pl->head.store(0,std::memory_order_relaxed);
+  pl->tail.store(0,std::memory_order_relaxed);
+  pl->stop.store(false,std::memory_order_relaxed);
+  for(int i=0;i<MAX_LINKS;i++)
+  {
+    pl->write_error[i].store(0,std::memory_order_relaxed);
+  }
+  pl->write_timeout_ms=write_timeout_ms;
+  pl->dropped=0;
+  resetHistogram(&pl->write_histogram);
+  pl->event_fd=eventfd(0,EFD_CLOEXEC);
+  if(pl->event_fd<0)
+  {
+    return -1;
+  }
+  if(writer_sched_fifo>0&&mlockall(MCL_CURRENT|MCL_FUTURE)<0)
+  {
+    fprintf(stderr,"[%s] %s:%u # mlockall: %s\n",__DATE__,__FILE__,__LINE__,strerror(errno));
+  }
+  ret=pthread_create(&pl->writer,NULL,writerThread,pl);
+  if(ret!=0)
+  {
+    errno=ret;
+    close(pl->event_fd);
+    return -1;
+  }
+  return 0;
+}
+
+void stopPipeline(Pipeline *pl)
+{
+  uint64_t one=1;
+  pl->stop.store(true,std::memory_order_release);
+  if(write(pl->event_fd,&one,sizeof(one))<0)
+  {
+    debug("eventfd write failed");
+  }
+  pthread_join(pl->writer,NULL);
+  close(pl->event_fd);
+  mergeHistogram(&cycle_histogram[HIST_WRITE],&pl->write_histogram);
+}
+
+/* @submitCycle
+ * @brief Encode one cycle into a free slot and wake the writer thread
+ * @detail api is NULL unless xbee_api_mode.
+ */
+void submitCycle(Pipeline *pl,SerialLink *links,int count,ApiPort *api)
+{
+  uint64_t one=1;
+  unsigned h=pl->head.load(std::memory_order_relaxed);
+
+  if(h-pl->tail.load(std::memory_order_acquire)>=PIPELINE_DEPTH)
+  {
+    pl->dropped++;
+    return;
+  }
+
+  const int outq=api!=NULL?checkOutputQueue(api->fd,&api->outq):OUTQ_SEND;
+  if(outq==OUTQ_SKIP)
+  {
+    return;
+  }
+  for(int i=0;i<count&&outq==OUTQ_FLUSHED;i++)
+  {
+    resendAfterFlush(&links[i]);      // every robot shares the coordinator
+  }
+
+  CycleBatch &batch=pl->slots[h%PIPELINE_DEPTH];
+  batch.count=count;
+  batch.api_fd=-1;
+  if(api!=NULL)
+  {
+    encodeApiCycle(api,links,count);
+    batch.api_fd=api->fd;
+    batch.api_frames=api->tx_buffer;
+  }
+  else for(int i=0;i<count;i++)
+  {
+    batch.fd[i]=links[i].fd;
+    batch.frames[i].clear();
+    const int link_outq=links[i].fd>=0?checkOutputQueue(links[i].fd,&links[i].outq):OUTQ_SKIP;
+    if(link_outq==OUTQ_SKIP)
+    {
+      batch.fd[i]=-1;
+    }
+    else
+    {
+      if(link_outq==OUTQ_FLUSHED)
+      {
+        resendAfterFlush(&links[i]);
+      }
+      encodeCycle(&links[i]);
+      batch.frames[i]=links[i].tx_buffer;
+    }
+  }
+  pl->head.store(h+1,std::memory_order_release);
+  if(write(pl->event_fd,&one,sizeof(one))<0)
+  {
+    debug("eventfd write failed");
+  }
+}
+
+/* @closeSerialLink
+ * @brief Stop using a failed port, other robots keep running
+ */
+void closeSerialLink(int epfd,SerialLink *link)
+{
+  epoll_ctl(epfd,EPOLL_CTL_DEL,link->fd,NULL);
+  link->fd=-1;
+}
+
+/* @createSignalFd
+ * @brief Block SIGINT, SIGQUIT, SIGTERM and SIGHUP and receive them through signalfd
+ * @return signalfd, -1 on error
+ * @detail Call before creating any thread so every thread inherits the mask.
+ */
+int createSignalFd()
+{
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask,SIGINT);
+  sigaddset(&mask,SIGQUIT);
+  sigaddset(&mask,SIGTERM);
+  sigaddset(&mask,SIGHUP);
+  if(sigprocmask(SIG_BLOCK,&mask,NULL)<0)
+  {
+    return -1;
+  }
+  return signalfd(-1,&mask,SFD_NONBLOCK|SFD_CLOEXEC);
+}
+
+int addEpollFd(int epfd,int fd,uint32_t events)
+{
+  struct epoll_event ev;
+  memset(&ev,0,sizeof(ev));
+  ev.events=events;
+  ev.data.fd=fd;
+  return epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev);
+}
+
+/*
+ * Options and config file
+ * Every setting is one entry of option_table[]. On the command line it is
+ * "--name value" or "--name=value" (a bool alone means true), in the
+ * config file "name = value" per line with '#' comments. The file given
+ * with --config is read first, then --options, then positional arguments
+ * override both. On SIGHUP the file is read again: it is checked as a
+ * whole first, then only hot entries (rates, keep-alive, queue limits)
+ * are applied; the others are reported and need a restart. An entry also
+ * given on the command line keeps that value on SIGHUP too.
+ */
+enum OptionType
+{
+  OPT_INT,
+  OPT_BOOL,
+  OPT_UINT,           // accepts 0x prefix
+  OPT_U64,            // hex, e.g. random seed
+  OPT_POLICY,         // skip | catch-up
+  OPT_PORT,           // appended to serial_ports[]
+  OPT_ADDRESS,        // hex, appended to robot_address[]
+  OPT_PATH            // file name, kept until exit
+};
+
+enum OptionMode
+{
+  OPTION_CHECK,       // parse only
+  OPTION_STARTUP,     // apply every entry
+  OPTION_RELOAD       // apply hot entries, report the others
+};
+
+struct OptionDef
+{
+  const char *name;
+  int type;
+  void *value;
+  bool hot;           // applied on SIGHUP
+  const char *help;
+};
+
+const char *config_path=NULL;
+int option_ports=0,option_addresses=0;
+
+const OptionDef option_table[]={
+  {"port",              OPT_PORT,   NULL,                     false,"serial port, repeat for more robots"},
+  {"address",           OPT_ADDRESS,NULL,                     false,"64-bit address (hex) of a robot in API mode, repeat"},
+  {"hz",                OPT_INT,    &cycle_hz,                true, "transmit cycles per second"},
+  {"loop",              OPT_INT,    &loop_option,             false,"stop after this many cycles, 0 runs until a signal"},
+  {"baud",              OPT_INT,    &baud_rate,               false,"baud rate, must match BD of the XBee"},
+  {"latency-timer",     OPT_INT,    &latency_timer_ms,        false,"FTDI latency timer in ms, 0 keeps the driver default"},
+  {"rate-vector",       OPT_INT,    &rate_hz[0],              true, "datatype 0 send rate in Hz, 0 every cycle"},
+  {"rate-calib",        OPT_INT,    &rate_hz[1],              true, "datatype 1 send rate in Hz, 0 every cycle"},
+  {"rate-kicker",       OPT_INT,    &rate_hz[2],              true, "datatype 2 send rate in Hz, 0 every cycle"},
+  {"keepalive-vector",  OPT_INT,    &keepalive_ms[0],         true, "datatype 0 keep-alive in ms with send-only-changed"},
+  {"keepalive-calib",   OPT_INT,    &keepalive_ms[1],         true, "datatype 1 keep-alive in ms with send-only-changed"},
+  {"keepalive-kicker",  OPT_INT,    &keepalive_ms[2],         true, "datatype 2 keep-alive in ms with send-only-changed"},
+  {"send-only-changed", OPT_BOOL,   &send_only_changed,       true, "send a datatype only when it changed or its keep-alive expired"},
+  {"datatype-mask",     OPT_UINT,   &datatype_mask,           true, "bit i set sends datatype i"},
+  {"outq-limit",        OPT_INT,    &outq_limit_cycles,       true, "skip a cycle above this many cycles in the tty output queue"},
+  {"outq-flush",        OPT_INT,    &outq_flush_cycles,       true, "flush the tty output queue above this many cycles, 0 never"},
+  {"overrun",           OPT_POLICY, &overrun_policy,          false,"skip | catch-up missed cycles"},
+  {"pipeline",          OPT_BOOL,   &pipeline_mode,           false,"write in a separate writer thread"},
+  {"encoder-cpu",       OPT_INT,    &encoder_cpu,             false,"CPU of the event loop, -1 any"},
+  {"writer-cpu",        OPT_INT,    &writer_cpu,              false,"CPU of the writer thread, -1 any"},
+  {"writer-fifo",       OPT_INT,    &writer_sched_fifo,       false,"SCHED_FIFO priority of the writer thread, 0 off"},
+  {"histogram-interval",OPT_INT,    &histogram_dump_interval, true, "print latency histograms every N seconds, 0 at exit only (pipeline: write at exit)"},
+  {"api",               OPT_BOOL,   &xbee_api_mode,           false,"XBee API mode (AP=2) through one coordinator"},
+  {"broadcast",         OPT_BOOL,   &xbee_broadcast,          false,"API mode: broadcast TX Requests with robot select"},
+  {"frame-version",     OPT_INT,    &frame_version,           false,"1 sum, 2 CRC-16, 0 negotiate"},
+  {"multi-record",      OPT_BOOL,   &multi_record,            false,"one frame per cycle"},
+  {"vector-delta",      OPT_BOOL,   &vector_delta,            false,"delta-encoded velocity"},
+  {"reliable",          OPT_BOOL,   &reliable_delivery,       false,"ACKed calib and kicker"},
+  {"seed",              OPT_U64,    &random_seed,             false,"seed of simulated data (hex), 0 random"},
+  {"shm",               OPT_PATH,   &shm_name,                false,"take commands from this shared-memory ring (xbee_shm.h) instead of the simulation"},
+  {"metrics-port",      OPT_INT,    &metrics_port,            false,"serve Prometheus /metrics on this TCP port, 0 off"},
+  {"adaptive-rate",     OPT_BOOL,   &adaptive_rate,           true, "slow down backoff-mask datatypes while a link is congested"},
+  {"backoff-mask",      OPT_UINT,   &backoff_mask,            true, "bit i set lets adaptive-rate slow down datatype i"},
+  {"quality-errors",    OPT_INT,    &quality_error_percent,   true, "congested above this percent of broken frames from the robot"},
+  {"quality-ack-ms",    OPT_INT,    &quality_ack_ms,          true, "congested above this average ACK latency in ms"},
+  {"quality-rssi",      OPT_INT,    &quality_rssi_dbm,        true, "congested below this RSSI in dBm (API mode)"},
+  {"trace",             OPT_PATH,   &trace_path,              false,"record a binary trace of every frame to this file"},
+  {"capture",           OPT_PATH,   &capture_path,            false,"append every frame to this memory-mapped log for replay"},
+};
+const size_t OPTION_COUNT=sizeof(option_table)/sizeof(option_table[0]);
+bool option_on_command_line[OPTION_COUNT];  // skipped by OPTION_RELOAD
+
+const OptionDef *findOption(const char *name)
+{
+  for(size_t i=0;i<OPTION_COUNT;i++)
+  {
+    if(strcmp(option_table[i].name,name)==0)
+    {
+      return &option_table[i];
+    }
+  }
+  return NULL;
+}
+
+bool parseBool(const char *text,bool *out)
+{
+  if(strcmp(text,"1")==0||strcmp(text,"true")==0||strcmp(text,"on")==0||strcmp(text,"yes")==0)
+  {
+    *out=true;
+    return true;
+  }
+  if(strcmp(text,"0")==0||strcmp(text,"false")==0||strcmp(text,"off")==0||strcmp(text,"no")==0)
+  {
+    *out=false;
+    return true;
+  }
+  return false;
+}
+
+/* @applyOption
+ * @brief Parse text for opt and store it according to mode
+ * @return 0 on success, -1 if text is not valid for opt
+ */
+int applyOption(const OptionDef *opt,const char *text,int mode)
+{
+  char *end=NULL;
+  long number=0;
+  unsigned long long u64=0;
+  bool flag=false;
+  int policy=0;
+
+  switch(opt->type)
+  {
+    case OPT_INT:
+      number=strtol(text,&end,10);
+      if(end==text||*end!='\0'||number<INT_MIN||number>INT_MAX)
+      {
+        return -1;
+      }
+      if(mode==OPTION_STARTUP||(mode==OPTION_RELOAD&&opt->hot))
+      {
+        *(int*)opt->value=(int)number;
+      }
+      else if(mode==OPTION_RELOAD&&*(int*)opt->value!=(int)number)
+      {
+        printf("%s: needs a restart, not changed\n",opt->name);
+      }
+      return 0;
+    case OPT_UINT:
+      number=strtol(text,&end,0);
+      if(end==text||*end!='\0'||number<0)
+      {
+        return -1;
+      }
+      if(mode==OPTION_STARTUP||(mode==OPTION_RELOAD&&opt->hot))
+      {
+        *(unsigned*)opt->value=(unsigned)number;
+      }
+      return 0;
+    case OPT_BOOL:
+      if(!parseBool(text,&flag))
+      {
+        return -1;
+      }
+      if(mode==OPTION_STARTUP||(mode==OPTION_RELOAD&&opt->hot))
+      {
+        *(bool*)opt->value=flag;
+      }
+      else if(mode==OPTION_RELOAD&&*(bool*)opt->value!=flag)
+      {
+        printf("%s: needs a restart, not changed\n",opt->name);
+      }
+      return 0;
+    case OPT_U64:
+    case OPT_ADDRESS:
+      u64=strtoull(text,&end,16);
+      if(end==text||*end!='\0')
+      {
+        return -1;
+      }
+      if(mode!=OPTION_STARTUP)
+      {
+        return 0;
+      }
+      if(opt->type==OPT_U64)
+      {
+        *(uint64_t*)opt->value=u64;
+      }
+      else if(option_addresses<MAX_LINKS)
+      {
+        robot_address[option_addresses++]=u64;
+      }
+      return 0;
+    case OPT_POLICY:
+      if(strcmp(text,"skip")==0)
+      {
+        policy=OVERRUN_SKIP;
+      }
+      else if(strcmp(text,"catch-up")==0)
+      {
+        policy=OVERRUN_CATCH_UP;
+      }
+      else
+      {
+        return -1;
+      }
+      if(mode==OPTION_STARTUP)
+      {
+        *(int*)opt->value=policy;
+      }
+      else if(mode==OPTION_RELOAD&&*(int*)opt->value!=policy)
+      {
+        printf("%s: needs a restart, not changed\n",opt->name);
+      }
+      return 0;
+    case OPT_PORT:
+      if(*text=='\0')
+      {
+        return -1;
+      }
+      if(mode==OPTION_STARTUP&&option_ports<MAX_LINKS)
+      {
+        serial_ports[option_ports++]=strdup(text);   // kept until exit
+      }
+      return 0;
+    case OPT_PATH:
+      if(*text=='\0')
+      {
+        return -1;
+      }
+      if(mode==OPTION_STARTUP)
+      {
+        *(const char**)opt->value=strdup(text);
+      }
+      return 0;
+    default:
+      return -1;
+  }
+}
+
+/* @loadConfigFile
+ * @return 0 on success, -1 on error (message is printed)
+ */
+int loadConfigFile(const char *path,int mode)
+{
+  char line[256];
+  unsigned lineno=0;
+  int ret=0;
+  FILE *fp=fopen(path,"r");
+
+  if(fp==NULL)
+  {
+    fprintf(stderr,"[%s] %s:%u # %s: %s\n",__DATE__,__FILE__,__LINE__,path,strerror(errno));
+    return -1;
+  }
+  while(fgets(line,sizeof(line),fp)!=NULL)
+  {
+    lineno++;
+    char *hash=strchr(line,'#');
+    if(hash!=NULL)
+    {
+      *hash='\0';
+    }
+  // key [=] value, surrounding blanks removed
+    char *key=line+strspn(line," \t\r\n");
+    if(*key=='\0')
+    {
+      continue;
+    }
+    char *value=key+strcspn(key," \t=\r\n");
+    char *key_end=value;
+    value+=strspn(value," \t=");
+    char *value_end=value+strlen(value);
+    while(value_end>value&&strchr(" \t\r\n",value_end[-1])!=NULL)
+    {
+      value_end--;
+    }
+    *key_end='\0';
+    *value_end='\0';
+    const OptionDef *opt=findOption(key);
+    const bool kept=opt!=NULL&&mode==OPTION_RELOAD&&option_on_command_line[opt-option_table];
+    if(opt==NULL||applyOption(opt,value,kept?OPTION_CHECK:mode)<0)
+    {
+      fprintf(stderr,"[%s] %s:%u # %s:%u: %s %s\n",__DATE__,__FILE__,__LINE__,path,lineno,
+              opt==NULL?"unknown option":"bad value for",key);
+      ret=-1;
+    }
+    else if(kept&&opt->hot)
+    {
+      printf("%s: given on the command line, not changed\n",opt->name);
+    }
+  }
+  fclose(fp);
+  return ret;
+}
+
+void printUsage(const char *prog)
+{
+  printf("usage: %s [--option value ...] [hz [loop [port...|coordinator address...]]]\n",prog);
+  printf("       %s bench [seconds] | bench escape | bench roundtrip [millions]\n",prog);
+  printf("       %s trace FILE          print a file written with --trace\n",prog);
+  printf("       %s [--port ...] replay FILE [speed]   send a --capture log again, speed 0 back-to-back\n",prog);
+  printf("       %s --shm NAME shm-feed [hz]   push simulated commands to a running --shm NAME\n",prog);
+  printf("  --%-20s %s\n","config FILE","read \"option = value\" lines, reread on SIGHUP");
+  for(size_t i=0;i<OPTION_COUNT;i++)
+  {
+    printf("  --%-20s %s%s\n",option_table[i].name,option_table[i].help,option_table[i].hot?" (SIGHUP)":"");
+  }
+}
+
+/* @parseOptions
+ * @brief Apply the config file and --options of argv
+ * @param[out] positional argv[0] and the positional arguments in order
+ * @return 0 on success, 1 after --help, -1 on error (message is printed)
+ */
+int parseOptions(int argc,char **argv,std::vector<char*> *positional)
+{
+  positional->clear();
+  positional->push_back(argv[0]);
+  for(int i=1;i<argc;i++)
+  {
+    if(strncmp(argv[i],"--config",8)==0&&(argv[i][8]=='='||argv[i][8]=='\0'))
+    {
+      config_path=argv[i][8]=='='?argv[i]+9:(i+1<argc?argv[++i]:NULL);
+    }
+  }
+  if(config_path!=NULL&&loadConfigFile(config_path,OPTION_STARTUP)<0)
+  {
+    return -1;
+  }
+
+  for(int i=1;i<argc;i++)
+  {
+    if(strncmp(argv[i],"--",2)!=0)
+    {
+      positional->push_back(argv[i]);
+      continue;
+    }
+    char name[64];
+    const char *arg=argv[i]+2;
+    const char *eq=strchr(arg,'=');
+    size_t len=eq!=NULL?(size_t)(eq-arg):strlen(arg);
+    if(len>=sizeof(name))
+    {
+      len=sizeof(name)-1;
+    }
+    memcpy(name,arg,len);
+    name[len]='\0';
+    if(strcmp(name,"help")==0)
+    {
+      printUsage(argv[0]);
+      return 1;
+    }
+    if(strcmp(name,"config")==0)
+    {
+      i+=eq==NULL?1:0;       // read above
+      continue;
+    }
+    const OptionDef *opt=findOption(name);
+    const char *value=eq!=NULL?eq+1:NULL;
+    if(opt!=NULL&&value==NULL)
+    {
+      value=opt->type==OPT_BOOL?"true":(i+1<argc?argv[++i]:NULL);
+    }
+    if(opt==NULL||value==NULL||applyOption(opt,value,OPTION_STARTUP)<0)
+    {
+      fprintf(stderr,"[%s] %s:%u # %s --%s\n",__DATE__,__FILE__,__LINE__,
+              opt==NULL?"unknown option":"bad value for",name);
+      return -1;
+    }
+    option_on_command_line[opt-option_table]=true;
+  }
+  // positional hz and loop override the file like their --options
+  if(positional->size()>=2)
+  {
+    option_on_command_line[findOption("hz")-option_table]=true;
+  }
+  if(positional->size()>=3)
+  {
+    option_on_command_line[findOption("loop")-option_table]=true;
+  }
+
+  // --port/--address lists replace the defaults
+  if(xbee_api_mode&&option_addresses>0)
+  {
+    num_links=option_addresses;
+  }
+  else if(!xbee_api_mode&&option_ports>0)
+  {
+    num_links=option_ports;
+  }
+  return 0;
+}
+
+/* @reloadConfig
+ * @brief Reread config_path on SIGHUP and apply its hot entries
+ * @detail Nothing is changed if any line of the file is invalid.
+ */
+void reloadConfig(PeriodicTimer *timer)
+{
+  const int old_hz=cycle_hz;
+
+  if(config_path==NULL)
+  {
+    printf("SIGHUP: no config file\n");
+    return;
+  }
+  if(loadConfigFile(config_path,OPTION_CHECK)<0)
+  {
+    printf("SIGHUP: %s has errors, nothing changed\n",config_path);
+    return;
+  }
+  loadConfigFile(config_path,OPTION_RELOAD);
+  if(cycle_hz<=0||100000<=cycle_hz)
+  {
+    cycle_hz=old_hz;
+  }
+  if(cycle_hz!=old_hz)
+  {
+    setOutputQueueBudget(cycle_hz);
+    setTickBudget(cycle_hz);
+    if(setPeriodicTimerPeriod(timer,1000000000LL/cycle_hz)<0)
+    {
+      fprintf(stderr,"[%s] %s:%u # timerfd: %s\n",__DATE__,__FILE__,__LINE__,strerror(errno));
+    }
+    if(!loop_count_enable)
+    {
+      loop_length=cycle_hz;
+    }
+  }
+  printf("SIGHUP: reloaded %s, %d[Hz], rate %d/%d/%d[Hz]\n",config_path,cycle_hz,rate_hz[0],rate_hz[1],rate_hz[2]);
+}
+
+/*
+ * Benchmark over a pseudo-terminal loopback
+ * "usbserial-xbee bench [seconds]" needs no hardware: transmitCycle()
+ * writes to the slave side of a pty while a reader thread decodes the
+ * master side with FrameDecoder. Every velocity record (datatype 0, 4 or 5) is matched with
+ * the time its cycle was started, which gives end-to-end latency through
+ * encode, write() and the tty layer. Records are matched by the vector
+ * they carry (deltas applied), not by count, so a cycle which sent no
+ * velocity doesn't shift the samples after it. Each run sweeps one rate and one
+ * datatype mix; rate 0 sends back-to-back as fast as possible.
+ * TRACE() records nothing here, -DNDEBUG removes even its branch.
+ */
+struct BenchReader
+{
+  int fd;                                 // pty master
+  std::atomic<bool> stop;
+  std::atomic<size_t> received;           // velocity records decoded
+  std::atomic<uint64_t> bytes;
+  size_t capacity;                        // of recv_ns[] and recv_vector[]
+  int64_t *recv_ns;                       // arrival time of each velocity record
+  VectorData *recv_vector;                // its vector, deltas applied
+  VectorData ref;                         // last vector rebuilt from the stream
+  FrameDecoder decoder;
+  LatencyHistogram latency;
+};
+
+inline uint16_t applyVectorDelta(uint16_t ref,uint32_t delta,unsigned bits)
+{
+  const int d=(int)(delta<<(32-bits))>>(32-bits);     // sign-extend
+  return (uint16_t)((ref+d)&0xFFF);
+}
+
+void benchFrameHandler(const uint8_t *payload,size_t len,void *user)
+{
+  BenchReader *reader=(BenchReader*)user;
+  const size_t n=reader->received.load(std::memory_order_relaxed);
+  (void)len;
+  switch(payload[0]>>(8-DATATYPE_BITS))
+  {
+    case VectorSchema::datatype:
+    {
+      uint32_t v[VectorSchema::field_count];
+      VectorSchema::unpack(payload,v);
+      reader->ref.x_vector=(uint16_t)v[0];
+      reader->ref.y_vector=(uint16_t)v[1];
+      reader->ref.th_vector=(uint16_t)v[3];
+      break;
+    }
+    case VectorDelta2Schema::datatype:
+    {
+      uint32_t v[VectorDelta2Schema::field_count];
+      VectorDelta2Schema::unpack(payload,v);
+      reader->ref.x_vector=applyVectorDelta(reader->ref.x_vector,v[0],4);
+      reader->ref.y_vector=applyVectorDelta(reader->ref.y_vector,v[1],4);
+      reader->ref.th_vector=applyVectorDelta(reader->ref.th_vector,v[2],4);
+      break;
+    }
+    case VectorDelta3Schema::datatype:
+    {
+      uint32_t v[VectorDelta3Schema::field_count];
+      VectorDelta3Schema::unpack(payload,v);
+      reader->ref.x_vector=applyVectorDelta(reader->ref.x_vector,v[0],7);
+      reader->ref.y_vector=applyVectorDelta(reader->ref.y_vector,v[1],7);
+      reader->ref.th_vector=applyVectorDelta(reader->ref.th_vector,v[2],7);
+      break;
+    }
+    default:
+      return;
+  }
+  if(n<reader->capacity)
+  {
+    reader->recv_ns[n]=getMonotonicNs();
+    reader->recv_vector[n]=reader->ref;
+  }
+  reader->received.store(n+1,std::memory_order_release);
+}
+
+void *benchReaderThread(void *arg)
+{
+  BenchReader *reader=(BenchReader*)arg;
+  uint8_t buf[4096];
+  struct pollfd pfd;
+  ssize_t ret=0;
+
+  pfd.fd=reader->fd;
+  pfd.events=POLLIN;
+  while(!reader->stop.load(std::memory_order_acquire))
+  {
+    if(poll(&pfd,1,10)<=0)
+    {
+      continue;
+    }
+    while((ret=read(reader->fd,buf,sizeof(buf)))>0)
+    {
+      reader->bytes.fetch_add(ret,std::memory_order_relaxed);
+      feedFrameDecoder(&reader->decoder,buf,ret);
+    }
+  }
+  return NULL;
+}
+
+/* @runBenchmark
+ * @brief Send cycles at hz with datatype mask over a fresh pty and print one result line
+ * @return 0 on success, -1 on error (errno is set)
+ */
+int runBenchmark(int hz,unsigned mask,const char *mix,double seconds)
+{
+  const size_t cycles=hz>0?(size_t)(hz*seconds):(size_t)(20000*seconds);
+  std::vector<int64_t> sent_ns(cycles),recv_ns(cycles);   // allocated before the timed loop
+  std::vector<VectorData> sent_vector(cycles),recv_vector(cycles);
+  std::vector<bool> sent_velocity(cycles,false);
+  static SerialLink link;
+  static BenchReader reader;
+  PeriodicTimer timer;
+  pthread_t thread;
+  uint64_t expirations=0;
+  int master=-1,slave=-1;
+  int64_t start=0,elapsed=0;
+  unsigned long syscalls=0,velocity=0;
+  size_t matched=0;
+
+  master=posix_openpt(O_RDWR|O_NOCTTY|O_NONBLOCK);
+  if(master<0||grantpt(master)<0||unlockpt(master)<0)
+  {
+    return -1;
+  }
+  slave=openSerialPort(ptsname(master),baud_rate,latency_timer_ms);
+  if(slave<0)
+  {
+    close(master);
+    return -1;
+  }
+
+  initSerialLink(&link,"pty",0,slave,1000);
+  datatype_mask=mask;
+  setOutputQueueBudget(hz);
+  reader.fd=master;
+  reader.stop.store(false);
+  reader.received.store(0);
+  reader.bytes.store(0);
+  reader.capacity=cycles;
+  reader.recv_ns=recv_ns.data();
+  reader.recv_vector=recv_vector.data();
+  reader.ref.x_vector=reader.ref.y_vector=reader.ref.th_vector=0;
+  initFrameDecoder(&reader.decoder,benchFrameHandler,&reader);
+  reader.decoder.multi_record=true;     // decodes host frames
+  reader.decoder.version=link.frame_version;
+  registerReliableSizes(&reader.decoder);
+  resetHistogram(&reader.latency);
+  reader.latency.name="latency";
+  initCycleHistograms();
+  if(pthread_create(&thread,NULL,benchReaderThread,&reader)!=0)
+  {
+    close(slave);
+    close(master);
+    return -1;
+  }
+
+  if(hz>0&&initPeriodicTimer(&timer,1000000000LL/hz,OVERRUN_SKIP)<0)
+  {
+    const int err=errno;
+    reader.stop.store(true,std::memory_order_release);
+    pthread_join(thread,NULL);
+    close(slave);
+    close(master);
+    errno=err;
+    return -1;
+  }
+  syscalls=txSyscalls().load();
+  start=getMonotonicNs();
+  for(size_t c=0;c<cycles&&!errorFlag;c++)
+  {
+    if(hz>0)
+    {
+      struct pollfd pfd={timer.fd,POLLIN,0};
+      while(poll(&pfd,1,-1)<0&&errno==EINTR);
+      expirations=0;
+      if(read(timer.fd,&expirations,sizeof(expirations))<0)
+      {
+        debug("timerfd read failed");
+      }
+    }
+    sent_ns[c]=getMonotonicNs();
+    velocity=link.sent[VectorSchema::datatype];
+    if(transmitCycle(&link)<0)
+    {
+      break;
+    }
+    sent_velocity[c]=link.sent[VectorSchema::datatype]!=velocity;
+    sent_vector[c]=robot_command[link.robot].vector_data.load();
+  }
+  elapsed=getMonotonicNs()-start;
+  syscalls=txSyscalls().load()-syscalls;
+
+  // let the reader drain the pty
+  for(int wait=0;wait<100&&reader.received.load()<link.sent[VectorSchema::datatype];wait++)
+  {
+    usleep(10000);
+  }
+  reader.stop.store(true,std::memory_order_release);
+  pthread_join(thread,NULL);
+  close(slave);
+  close(master);
+  if(hz>0)
+  {
+    close(timer.fd);
+  }
+
+  // each record belongs to the next cycle which sent the same vector
+  const size_t received=std::min(reader.received.load(),cycles);
+  for(size_t i=0,c=0;i<received;i++)
+  {
+    size_t k=c;
+    while(k<cycles&&!(sent_velocity[k]&&memcmp(&sent_vector[k],&recv_vector[i],sizeof(VectorData))==0))
+    {
+      k++;
+    }
+    if(k<cycles)
+    {
+      recordHistogram(&reader.latency,recv_ns[i]-sent_ns[k]);
+      matched++;
+      c=k+1;
+    }
+  }
+
+  unsigned long frames=0;
+  for(int i=0;i<MAX_DATA_TYPE;i++)
+  {
+    frames+=link.sent[i];
+  }
+  const double sec=elapsed/1e9;
+  const LatencyHistogram &enc=cycle_histogram[HIST_ENCODE];
+  printf("%6d %-13s %10.0f %10.0f %8.2f %9.0f %9.1f %9.1f %9.1f %9.1f %6s\n",
+         hz,mix,frames/sec,reader.bytes.load()/sec,frames>0?(double)syscalls/frames:0.0,
+         frames>0?(double)enc.sum/frames:0.0,
+         histogramPercentile(&reader.latency,50)/1000.0,histogramPercentile(&reader.latency,99)/1000.0,
+         histogramPercentile(&reader.latency,99.9)/1000.0,reader.latency.max/1000.0,
+         matched==link.sent[VectorSchema::datatype]&&reader.received.load()==matched?"ok":"LOST");
+  return 0;
+}
+
+int runBenchmarkSuite(double seconds)
+{
+  const int rates[]={120,500,1000,5000,0};
+  const struct { unsigned mask; const char *name; } mixes[]={
+    {0x1,"vector"},
+    {0x5,"vector+kicker"},
+    {0x7,"all"},
+  };
+
+  printf("%6s %-13s %10s %10s %8s %9s %9s %9s %9s %9s %6s\n",
+         "hz","mix","frames/s","bytes/s","sys/frm","enc ns/f","p50[us]","p99[us]","p99.9[us]","max[us]","check");
+  for(size_t r=0;r<sizeof(rates)/sizeof(rates[0])&&!errorFlag;r++)
+  {
+    for(size_t m=0;m<sizeof(mixes)/sizeof(mixes[0])&&!errorFlag;m++)
+    {
+      if(runBenchmark(rates[r],mixes[m].mask,mixes[m].name,seconds)<0)
+      {
+        fprintf(stderr,"[%s] %s:%u # benchmark: %s\n",__DATE__,__FILE__,__LINE__,strerror(errno));
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+ * Escape kernel microbenchmark
+ * "usbserial-xbee bench escape" times escapeAndSumScalar() against
+ * escapeAndSumVector() on random payloads of 16..4096 bytes. "low" has
+ * no HEAD_BYTE/ESCAPE_BYTE at all, "high" has one in every 8 bytes on
+ * average. Every run is checked to be bit-exact with the scalar kernel.
+ */
+double timeEscapeKernel(size_t (*kernel)(const uint8_t*,size_t,uint8_t*,uint32_t*),
+                        const std::vector<uint8_t> &in,std::vector<uint8_t> *out,uint32_t *sum,size_t *n)
+{
+  const int64_t budget=50000000;         // 50ms per measurement
+  int64_t start=getMonotonicNs(),elapsed=0;
+  size_t rounds=0;
+
+  do
+  {
+    for(int i=0;i<64;i++)
+    {
+      *sum=0;
+      *n=kernel(in.data(),in.size(),out->data(),sum);
+    }
+    rounds+=64;
+    elapsed=getMonotonicNs()-start;
+  } while(elapsed<budget);
+  return (double)elapsed/rounds/in.size();
+}
+
+int runEscapeBenchmark()
+{
+  const size_t sizes[]={16,32,64,256,1024,4096};
+  const struct { int one_in; const char *name; } densities[]={
+    {0,"low"},
+    {8,"high"},
+  };
+  std::mt19937 engine(1);
+  int failed=0;
+
+  printf("kernel: %s\n",ESCAPE_KERNEL);
+  printf("%6s %-5s %12s %12s %8s %6s\n","bytes","mix","scalar[ns/B]","vector[ns/B]","speedup","check");
+  for(size_t d=0;d<sizeof(densities)/sizeof(densities[0]);d++)
+  {
+    for(size_t z=0;z<sizeof(sizes)/sizeof(sizes[0]);z++)
+    {
+      std::vector<uint8_t> in(sizes[z]),ref(2*sizes[z]),out(2*sizes[z]);
+      for(size_t i=0;i<in.size();i++)
+      {
+        uint8_t b=(uint8_t)engine();
+        bool special=densities[d].one_in>0&&engine()%densities[d].one_in==0;
+        if(special)
+        {
+          b=engine()&1?HEAD_BYTE:ESCAPE_BYTE;
+        }
+        else if(b==HEAD_BYTE||b==ESCAPE_BYTE)
+        {
+          b=0;
+        }
+        in[i]=b;
+      }
+      uint32_t ref_sum=0,sum=0;
+      size_t ref_n=0,n=0;
+      double scalar=timeEscapeKernel(escapeAndSumScalar,in,&ref,&ref_sum,&ref_n);
+      double vector=timeEscapeKernel(escapeAndSumVector,in,&out,&sum,&n);
+      bool ok=n==ref_n&&sum==ref_sum&&memcmp(out.data(),ref.data(),n)==0;
+      failed|=!ok;
+      printf("%6zu %-5s %12.3f %12.3f %7.2fx %6s\n",sizes[z],densities[d].name,
+             scalar,vector,scalar/vector,ok?"ok":"DIFF");
+    }
+  }
+  return failed;
+}
+
+/*
+ * Round-trip property check
+ * "usbserial-xbee bench roundtrip [millions]" draws random field values
+ * over the full ranges of the callbacks (both ends of every field more
+ * often than uniform), packs and frames them with the code the loop uses,
+ * and checks against the reference packer and per-byte encoder below:
+ *  - packed payload equals the bit layout of the wire format comment
+ *  - encodeFrame() equals the reference, for V1, V2, multi-record frames
+ *    and payloads long enough for escapeAndSumVector(). A robot select
+ *    frame is version 1 in every batch, as encodeApiCycle() sends it.
+ *  - FrameDecoder fed in random chunk sizes gives every frame back in
+ *    order with its values. Every other batch has random garbage between
+ *    frames; garbage may decode into frames of its own, but a real frame
+ *    must never be lost or changed by the resync.
+ */
+struct RoundTripCase
+{
+  const char *name;
+  size_t field_count;
+  uint8_t datatype;
+  unsigned width[4];              // width 1 fields are "always 0"
+  void (*pack)(const uint32_t *values,Payload *buf);
+  bool (*check)(const uint8_t *payload,const uint32_t *values);
+};
+
+void packVectorCase(const uint32_t *values,Payload *buf)
+{
+  RobotCommand cmd={{(uint16_t)values[0],(uint16_t)values[1],(uint16_t)values[3]},0,0};
+  setSendDataFromROSBus(VectorSchema::datatype,cmd,buf);
+}
+
+void packCalibCase(const uint32_t *values,Payload *buf)
+{
+  RobotCommand cmd={{0,0,0},(uint16_t)values[0],0};
+  setSendDataFromROSBus(CalibSchema::datatype,cmd,buf);
+}
+
+void packKickerCase(const uint32_t *values,Payload *buf)
+{
+  RobotCommand cmd={{0,0,0},0,(uint16_t)values[0]};
+  setSendDataFromROSBus(KickerSchema::datatype,cmd,buf);
+}
+
+template<class Schema>
+void packSchemaCase(const uint32_t *values,Payload *buf)
+{
+  uint32_t v[Schema::field_count];
+  memcpy(v,values,sizeof(v));
+  Schema::pack(v,buf);
+}
+
+template<class Schema>
+bool checkSchemaCase(const uint8_t *payload,const uint32_t *values)
+{
+  uint32_t v[Schema::field_count];
+  return Schema::unpack(payload,v)==Schema::datatype&&memcmp(v,values,sizeof(v))==0;
+}
+
+// host -> robot datatypes, records of a multi-record frame are drawn from these
+const RoundTripCase round_trip_cases[]={
+  {"vector",4,VectorSchema::datatype,{12,12,1,12},packVectorCase,checkSchemaCase<VectorSchema>},
+  {"calib",1,CalibSchema::datatype,{13},packCalibCase,checkSchemaCase<CalibSchema>},
+  {"kicker",1,KickerSchema::datatype,{5},packKickerCase,checkSchemaCase<KickerSchema>},
+  {"select",1,RobotSelectSchema::datatype,{5},packSchemaCase<RobotSelectSchema>,checkSchemaCase<RobotSelectSchema>},
+  {"delta2",4,VectorDelta2Schema::datatype,{4,4,4,1},packSchemaCase<VectorDelta2Schema>,checkSchemaCase<VectorDelta2Schema>},
+  {"delta3",3,VectorDelta3Schema::datatype,{7,7,7},packSchemaCase<VectorDelta3Schema>,checkSchemaCase<VectorDelta3Schema>},
+};
+const size_t ROUND_TRIP_CASES=sizeof(round_trip_cases)/sizeof(round_trip_cases[0]);
+
+/* @referencePack
+ * @brief Pack datatype and fields one bit at a time, MSB first, zero padded
+ * @return Payload size in bytes
+ */
+size_t referencePack(const RoundTripCase &c,const uint32_t *values,uint8_t *out)
+{
+  size_t bit=0;
+  memset(out,0,MAX_PAYLOAD_SIZE);
+  for(int k=DATATYPE_BITS-1;k>=0;k--,bit++)
+  {
+    out[bit/8]|=((c.datatype>>k)&1)<<(7-bit%8);
+  }
+  for(size_t f=0;f<c.field_count;f++)
+  {
+    for(int k=c.width[f]-1;k>=0;k--,bit++)
+    {
+      out[bit/8]|=((values[f]>>k)&1)<<(7-bit%8);
+    }
+  }
+  return (bit+7)/8;
+}
+
+/* @referenceEncodeFrame
+ * @brief The original per-byte frame loop with a bitwise CRC-16
+ * @param[out] out Must have 1+2*len+2*MAX_CHECK_SIZE bytes free.
+ * @return Number of bytes written to out
+ */
+size_t referenceEncodeFrame(const uint8_t *payload,size_t len,uint8_t *out,int version)
+{
+  uint8_t checksum=HEAD_BYTE,check[MAX_CHECK_SIZE];
+  uint16_t crc=0xFFFF;
+  size_t n=0,check_size=0;
+
+  out[n++]=HEAD_BYTE;
+  for(size_t i=0;i<len;i++)
+  {
+    uint8_t tmp=payload[i];
+    crc^=(uint16_t)(tmp<<8);
+    for(int bit=0;bit<8;bit++)
+    {
+      crc=(crc&0x8000)?(uint16_t)((crc<<1)^0x1021):(uint16_t)(crc<<1);
+    }
+    if(tmp==HEAD_BYTE||tmp==ESCAPE_BYTE)
+    {
+      out[n++]=ESCAPE_BYTE;
+      tmp^=ESCAPE_MASK;
+    }
+    out[n++]=tmp;
+    checksum+=tmp;
+  }
+  if(version==FRAME_V2)
+  {
+    check[check_size++]=(uint8_t)(crc>>8);
+    check[check_size++]=(uint8_t)(crc&0xFF);
+  }
+  else
+  {
+    check[check_size++]=checksum;
+  }
+  for(size_t i=0;i<check_size;i++)
+  {
+    if(check[i]==HEAD_BYTE||check[i]==ESCAPE_BYTE)
+    {
+      out[n++]=ESCAPE_BYTE;
+      out[n++]=check[i]^ESCAPE_MASK;
+    }
+    else
+    {
+      out[n++]=check[i];
+    }
+  }
+  return n;
+}
+
+// one record the decoder must deliver
+struct RoundTripRecord
+{
+  uint8_t kind;                   // index of round_trip_cases
+  uint8_t size;
+  uint8_t payload[MAX_PAYLOAD_SIZE];
+  uint32_t values[4];
+};
+
+struct RoundTripSink
+{
+  std::vector<uint8_t> bytes;     // delivered payloads back to back
+  std::vector<size_t> ends;       // end of each payload in bytes
+};
+
+void roundTripHandler(const uint8_t *payload,size_t len,void *user)
+{
+  RoundTripSink *sink=(RoundTripSink*)user;
+  sink->bytes.insert(sink->bytes.end(),payload,payload+len);
+  sink->ends.push_back(sink->bytes.size());
+}
+
+// full range, with 0, 1, max-1 and max one draw in 8
+uint32_t drawField(std::mt19937 &engine,unsigned width)
+{
+  const uint32_t max=(uint32_t)((1ULL<<width)-1);
+  if(width==1)
+  {
+    return 0;
+  }
+  if(engine()%8==0)
+  {
+    const uint32_t edge[]={0,1,max-1,max};
+    return edge[engine()%4];
+  }
+  return engine()&max;
+}
+
+// robot select goes out as version 1 whatever the link uses
+inline int frameVersionOf(const RecordBuffer &frame,int version)
+{
+  return frame.size==RobotSelectSchema::payload_size&&(frame.data[0]>>(8-DATATYPE_BITS))==RobotSelectSchema::datatype?FRAME_V1:version;
+}
+
+int runRoundTripBenchmark(double millions)
+{
+  const size_t BATCH=4096,MAX_RECORDS=(RecordBuffer::capacity()-1)/MAX_PAYLOAD_SIZE;
+  const unsigned long total=(unsigned long)(millions*1000000);
+  std::mt19937 engine(1);
+  std::vector<RoundTripRecord> expected;
+  std::vector<RecordBuffer> frames(BATCH);
+  std::vector<uint8_t> wire(BATCH*(1+2*RecordBuffer::capacity()+2*MAX_CHECK_SIZE)),ref(wire.size()),line;
+  std::vector<size_t> wire_ends(BATCH);
+  std::vector<uint8_t> long_in(512),long_out(1+2*512+2*MAX_CHECK_SIZE),long_ref(long_out.size());
+  RoundTripSink sink;
+  FrameDecoder dec;
+  unsigned long frame_count=0,records=0,wire_bytes=0,spurious=0,long_frames=0;
+  unsigned long pack_errors=0,encode_errors=0,lost=0,value_errors=0;
+  int64_t encode_ns=0,decode_ns=0;
+
+  for(unsigned long batch=0;frame_count<total;batch++)
+  {
+    const int version=engine()&1?FRAME_V2:FRAME_V1;
+    const bool noise=batch&1;
+    expected.clear();
+
+  // draw and pack: one record or a multi-record frame of 2..MAX_RECORDS
+    for(size_t f=0;f<BATCH;f++)
+    {
+      RecordBuffer &frame=frames[f];
+      const size_t count=engine()%4==0?2+engine()%(MAX_RECORDS-1):1;
+      frame.clear();
+      if(count>1)
+      {
+        const uint32_t header[]={(uint32_t)count};
+        Payload p;
+        MultiRecordSchema::pack(header,&p);
+        frame.push_back(p.data[0]);
+      }
+      for(size_t r=0;r<count;r++)
+      {
+        RoundTripRecord rec;
+        uint8_t reference[MAX_PAYLOAD_SIZE];
+        Payload p;
+        rec.kind=(uint8_t)(engine()%ROUND_TRIP_CASES);
+        const RoundTripCase &c=round_trip_cases[rec.kind];
+        for(size_t k=0;k<c.field_count;k++)
+        {
+          rec.values[k]=drawField(engine,c.width[k]);
+        }
+        c.pack(rec.values,&p);
+        const size_t size=referencePack(c,rec.values,reference);
+        if(p.size!=size||memcmp(p.data,reference,size)!=0)
+        {
+          if(pack_errors++<5)
+          {
+            fprintf(stderr,"[%s] %s:%u # %s: packed %zu bytes differ from reference\n",__DATE__,__FILE__,__LINE__,c.name,p.size);
+          }
+        }
+        rec.size=(uint8_t)p.size;
+        memcpy(rec.payload,p.data,p.size);
+        for(size_t b=0;b<p.size;b++)
+        {
+          frame.push_back(p.data[b]);
+        }
+        expected.push_back(rec);
+      }
+    }
+
+  // optimized encoder, timed
+    int64_t start=getMonotonicNs();
+    size_t n=0;
+    for(size_t f=0;f<BATCH;f++)
+    {
+      n+=encodeFrame(frames[f].data,frames[f].size,wire.data()+n,frameVersionOf(frames[f],version));
+      wire_ends[f]=n;
+    }
+    encode_ns+=getMonotonicNs()-start;
+
+  // reference encoder, and the line the decoder reads
+    line.clear();
+    for(size_t f=0,at=0;f<BATCH;at=wire_ends[f++])
+    {
+      const int v=frameVersionOf(frames[f],version);
+      const size_t len=referenceEncodeFrame(frames[f].data,frames[f].size,ref.data(),v);
+      if(len!=wire_ends[f]-at||memcmp(ref.data(),wire.data()+at,len)!=0)
+      {
+        if(encode_errors++<5)
+        {
+          fprintf(stderr,"[%s] %s:%u # frame of %zu bytes (V%d) differs from reference\n",__DATE__,__FILE__,__LINE__,
+                  frames[f].size,v);
+        }
+      }
+      for(size_t k=noise?engine()%8:0;k>0;k--)
+      {
+        line.push_back(engine()%4==0?(engine()&1?HEAD_BYTE:ESCAPE_BYTE):(uint8_t)engine());
+      }
+      line.insert(line.end(),wire.begin()+at,wire.begin()+wire_ends[f]);
+    }
+
+  // payloads over 16 bytes take escapeAndSumVector() in V1
+    for(int k=0;k<16;k++)
+    {
+      const size_t len=16+engine()%(long_in.size()-15);
+      for(size_t i=0;i<len;i++)
+      {
+        long_in[i]=engine()%8==0?(engine()&1?HEAD_BYTE:ESCAPE_BYTE):(uint8_t)engine();
+      }
+      const size_t a=encodeFrame(long_in.data(),len,long_out.data(),version);
+      const size_t b=referenceEncodeFrame(long_in.data(),len,long_ref.data(),version);
+      if(a!=b||memcmp(long_out.data(),long_ref.data(),a)!=0)
+      {
+        if(encode_errors++<5)
+        {
+          fprintf(stderr,"[%s] %s:%u # long frame of %zu bytes (V%d) differs from reference\n",__DATE__,__FILE__,__LINE__,len,version);
+        }
+      }
+      long_frames++;
+    }
+
+  // decode in random read() sizes, timed
+    initFrameDecoder(&dec,roundTripHandler,&sink);
+    dec.version=version;
+    dec.multi_record=true;
+    sink.bytes.clear();
+    sink.ends.clear();
+    std::vector<size_t> chunks;
+    for(size_t at=0;at<line.size();)
+    {
+      const size_t len=std::min(line.size()-at,(size_t)(1+engine()%(engine()%4==0?256:16)));
+      chunks.push_back(len);
+      at+=len;
+    }
+    start=getMonotonicNs();
+    for(size_t c=0,at=0;c<chunks.size();at+=chunks[c++])
+    {
+      feedFrameDecoder(&dec,line.data()+at,chunks[c]);
+    }
+    decode_ns+=getMonotonicNs()-start;
+
+  // every expected record in order, anything else must come from garbage
+    size_t next=0;
+    for(size_t d=0,at=0;d<sink.ends.size();at=sink.ends[d++])
+    {
+      const size_t len=sink.ends[d]-at;
+      const uint8_t *got=sink.bytes.data()+at;
+      if(next<expected.size()&&len==expected[next].size&&memcmp(got,expected[next].payload,len)==0)
+      {
+        const RoundTripRecord &rec=expected[next++];
+        if(!round_trip_cases[rec.kind].check(got,rec.values))
+        {
+          if(value_errors++<5)
+          {
+            fprintf(stderr,"[%s] %s:%u # %s: unpacked values differ\n",__DATE__,__FILE__,__LINE__,round_trip_cases[rec.kind].name);
+          }
+        }
+      }
+      else
+      {
+        spurious++;
+      }
+    }
+    if(next<expected.size())
+    {
+      if(lost++<5)
+      {
+        fprintf(stderr,"[%s] %s:%u # batch %lu (V%d%s): %zu of %zu records lost\n",__DATE__,__FILE__,__LINE__,
+                batch,version,noise?", garbage":"",expected.size()-next,expected.size());
+      }
+    }
+    if(!noise&&dec.frames!=BATCH)
+    {
+      lost++;
+    }
+    frame_count+=BATCH;
+    records+=expected.size();
+    wire_bytes+=wire_ends[BATCH-1];
+  }
+
+  const bool ok=pack_errors==0&&encode_errors==0&&lost==0&&value_errors==0;
+  printf("kernel: %s\n",ESCAPE_KERNEL);
+  printf("frames %lu, records %lu, long frames %lu, spurious from garbage %lu\n",frame_count,records,long_frames,spurious);
+  printf("encode %8.1f Mframes/s %8.1f MB/s\n",frame_count*1000.0/encode_ns,wire_bytes*1000.0/encode_ns);
+  printf("decode %8.1f Mframes/s %8.1f MB/s\n",frame_count*1000.0/decode_ns,wire_bytes*1000.0/decode_ns);
+  printf("pack errors %lu, encode errors %lu, lost batches %lu, value errors %lu: %s\n",
+         pack_errors,encode_errors,lost,value_errors,ok?"ok":"FAIL");
+  return ok?0:1;
+}
+
+#ifdef XBEE_FUZZ
+/*
+ * libFuzzer target for the streaming decoder
+ * clang++ -std=c++11 -g -O1 -fsanitize=fuzzer,address -DXBEE_FUZZ usbserial-xbee.cpp -pthread
+ * The first input byte picks the frame version, multi_record and the
+ * read() chunk size, the rest is the received byte stream. Every payload
+ * the decoder delivers must have the registered size of its datatype and
+ * come back unchanged through encodeFrame() and a fresh decoder, however
+ * the resync got there.
+ */
+void fuzzFrameHandler(const uint8_t *payload,size_t len,void *user)
+{
+  const FrameDecoder *dec=(const FrameDecoder*)user;
+  const uint8_t type=payload[0]>>(8-DATATYPE_BITS);
+  uint8_t frame[1+2*RecordBuffer::capacity()+2*MAX_CHECK_SIZE];
+  RoundTripSink again;
+  FrameDecoder check;
+
+  if(len!=dec->payload_size[type]||(dec->multi_record&&type==MultiRecordSchema::datatype))
+  {
+    abort();
+  }
+  const bool v1=type==HelloSchema::datatype||(dec->multi_record&&type==RobotSelectSchema::datatype);
+  const size_t n=encodeFrame(payload,len,frame,v1?FRAME_V1:dec->version);
+  initFrameDecoder(&check,roundTripHandler,&again);
+  check.version=dec->version;
+  check.multi_record=dec->multi_record;
+  feedFrameDecoder(&check,frame,n);
+  if(again.ends.size()!=1||again.bytes.size()!=len||memcmp(again.bytes.data(),payload,len)!=0)
+  {
+    abort();
+  }
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data,size_t size)
+{
+  FrameDecoder dec;
+
+  if(size<1)
+  {
+    return 0;
+  }
+  initFrameDecoder(&dec,fuzzFrameHandler,&dec);
+  dec.version=data[0]&1?FRAME_V2:FRAME_V1;
+  dec.multi_record=data[0]&2;
+  const size_t chunk=1+(data[0]>>2);
+  for(size_t at=1;at<size;at+=chunk)
+  {
+    feedFrameDecoder(&dec,data+at,std::min(chunk,size-at));
+  }
+  if(3*dec.frames>size)     // HEAD_BYTE, datatype and check byte at least
+  {
+    abort();
+  }
+  return 0;
+}
+#endif
+
+/* @runReplay
+ * @brief "usbserial-xbee replay FILE [speed]": send a capture log again
+ * @param[in] speed 1 keeps the recorded timing, 2 is twice as fast,
+ *            0 sends back-to-back
+ * @return 0 on success, 1 on error (message is printed)
+ * @detail Tx record of port i goes to the i-th port (--port or positional),
+ *         in API mode every record goes to the coordinator. Rx records
+ *         are skipped.
+ */
+int runReplay(const char *path,double speed)
+{
+  struct stat st;
+  int fds[MAX_LINKS];
+  int fd=open(path,O_RDONLY);
+  const uint8_t *map=NULL;
+  unsigned long frames=0,bytes=0,skipped=0;
+  int64_t first=-1,start=0,max_late=0;
+  int ret=0;
+
+  if(fd<0||fstat(fd,&st)<0||(size_t)st.st_size<sizeof(CAPTURE_MAGIC)
+     ||(map=(const uint8_t*)mmap(NULL,st.st_size,PROT_READ,MAP_PRIVATE,fd,0))==MAP_FAILED
+     ||memcmp(map,CAPTURE_MAGIC,sizeof(CAPTURE_MAGIC))!=0)
+  {
+    fprintf(stderr,"[%s] %s:%u # %s: not a capture log\n",__DATE__,__FILE__,__LINE__,path);
+    return 1;
+  }
+  madvise((void*)map,st.st_size,MADV_SEQUENTIAL);
+  for(int i=0;i<num_links;i++)
+  {
+    fds[i]=(xbee_api_mode&&i>0)?fds[0]:openSerialPort(serial_ports[i],baud_rate,latency_timer_ms);
+    if(fds[i]<0)
+    {
+      fprintf(stderr,"[%s] %s:%u # open %s: %s\n",__DATE__,__FILE__,__LINE__,serial_ports[i],strerror(errno));
+      return 1;
+    }
+  }
+
+  size_t at=sizeof(CAPTURE_MAGIC);
+  CaptureRecord rec;
+  while(at+sizeof(rec)<=(size_t)st.st_size)
+  {
+    memcpy(&rec,map+at,sizeof(rec));
+    if(rec.len==0&&rec.ns==0)
+    {
+      break;                            // zero tail of a log cut by a crash
+    }
+    const uint8_t *frame=map+at+sizeof(rec);
+    at+=sizeof(rec)+rec.len;
+    if(at>(size_t)st.st_size)
+    {
+      break;                            // cut off while recording
+    }
+    if(rec.direction!=CAPTURE_TX)
+    {
+      continue;
+    }
+    if(rec.port>=num_links)
+    {
+      skipped++;
+      continue;
+    }
+    if(first<0)
+    {
+      first=rec.ns;
+      start=getMonotonicNs();
+    }
+    if(speed>0)
+    {
+      const int64_t due=start+(int64_t)((rec.ns-first)/speed);
+      const struct timespec ts=nsToTimespec(due);
+      while(clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,NULL)==EINTR);
+      max_late=std::max(max_late,getMonotonicNs()-due);
+    }
+    if(writeAll(fds[xbee_api_mode?0:rec.port],frame,rec.len,1000)<0)
+    {
+      fprintf(stderr,"[%s] %s:%u # write error %s: %s\n",__DATE__,__FILE__,__LINE__,
+              serial_ports[rec.port],strerror(errno));
+      ret=1;
+      break;
+    }
+    frames++;
+    bytes+=rec.len;
+  }
+  printf("replayed %lu frames, %lu bytes, skipped %lu, max late %.1f[us]\n",frames,bytes,skipped,max_late/1000.0);
+  munmap((void*)map,st.st_size);
+  close(fd);
+  for(int i=0;i<num_links;i++)
+  {
+    if(i==0||!xbee_api_mode)
+    {
+      close(fds[i]);
+    }
+  }
+  return ret;
+}
+
+/* @runShmFeed
+ * @brief "usbserial-xbee --shm NAME shm-feed [hz]": simulated ROS node
+ * @detail Pushes the simulation callbacks of every robot into the rings of
+ *         a running usbserial-xbee --shm NAME, until a signal or --loop
+ *         rounds. Shows what a nodelet publishing to shared memory does.
+ * @return 0 on success, 1 on error (message is printed)
+ */
+int runShmFeed(int hz)
+{
+  ShmCommandArea *area=shm_name!=NULL?openShmCommandArea(shm_name,false):NULL;
+  unsigned long pushed=0,dropped=0;
+  int64_t due=0;
+
+  if(area==NULL)
+  {
+    fprintf(stderr,"[%s] %s:%u # shm %s: %s\n",__DATE__,__FILE__,__LINE__,
+            shm_name!=NULL?shm_name:"(no --shm)",shm_name!=NULL?strerror(errno):"name needed");
+    return 1;
+  }
+  signal(SIGINT,signalHandler);
+  signal(SIGTERM,signalHandler);
+  due=getMonotonicNs();
+  for(int round=0;!errorFlag&&(loop_length<=0||round<loop_length);round++)
+  {
+    for(int r=0;r<num_links;r++)
+    {
+      uint32_t stamp[MAX_DATA_TYPE],before[MAX_DATA_TYPE];
+      loadRobotCommand(robot_command[r],before);
+      vectorCallback(r);
+      visionCallback(r);
+      kickerCallback(r);
+      const RobotCommand cmd=loadRobotCommand(robot_command[r],stamp);
+      ShmCommand c;
+      c.fields=SHM_VECTOR|SHM_CALIB;
+      if(stamp[KickerSchema::datatype]!=before[KickerSchema::datatype])
+      {
+        c.fields|=SHM_COMMAND;          // each push of a command is one kick
+      }
+      c.vector=cmd.vector;
+      c.calib_data=cmd.calib_data;
+      c.command=cmd.command;
+      c.stamp_ns=getMonotonicNs();
+      if(pushShmCommand(area,r,c))
+      {
+        pushed++;
+      }
+      else
+      {
+        dropped++;
+      }
+    }
+    due+=1000000000LL/hz;
+    const struct timespec ts=nsToTimespec(due);
+    while(clock_nanosleep(CLOCK_MONOTONIC,TIMER_ABSTIME,&ts,NULL)==EINTR&&!errorFlag);
+  }
+  printf("shm-feed pushed %lu, ring full %lu\n",pushed,dropped);
+  closeShmCommandArea(area);
+  return 0;
+}
+
+#ifndef XBEE_FUZZ
+int main(int argc, char** argv)
+{
+  //ros::init(argc,argv,"sub_node_name");
+  //ros::NodeHandle nh_vector,nh_vision,nh_kicker;
+  //ros::Subscriber sub_vector=nh_vector.subscribe("vector_pub_node_name",1000,vectorCallback);
+  //ros::Subscriber sub_vision=nh_vector.subscribe("vision_pub_node_name",1000,visionCallback);
+  //ros::Subscriber sub_kicker=nh_vector.subscribe("kicker_pub_node_name",1000,kickerCallback);
+  //ros::Rate rate(60);
+
+
+  debug("main\n");
+  if(argc>=2&&strcmp(argv[1],"bench")==0)
+  {
+    if(argc>=3&&strcmp(argv[2],"escape")==0)
+    {
+      return runEscapeBenchmark();
+    }
+    if(argc>=3&&strcmp(argv[2],"roundtrip")==0)
+    {
+      return runRoundTripBenchmark(argc>=4&&atof(argv[3])>0?atof(argv[3]):1.0);
+    }
+    return runBenchmarkSuite(argc>=3&&atof(argv[2])>0?atof(argv[2]):1.0);
+  }
+  if(argc>=3&&strcmp(argv[1],"trace")==0)
+  {
+    return printTraceFile(argv[2]);
+  }
+
+  std::vector<char*> positional;
+  int parsed=parseOptions(argc,argv,&positional);
+  if(parsed!=0)
+  {
+    return parsed<0?1:0;
+  }
+  loop_length=loop_option;
+  if(positional.size()>=3&&strcmp(positional[1],"replay")==0)
+  {
+    return runReplay(positional[2],positional.size()>=4?atof(positional[3]):1.0);
+  }
+  if(positional.size()>=2&&strcmp(positional[1],"shm-feed")==0)
+  {
+    return runShmFeed(positional.size()>=3&&atoi(positional[2])>0?atoi(positional[2]):cycle_hz);
+  }
+  setParameterFromCommandLine((int)positional.size(),positional.data(),&cycle_hz,&loop_length);
+  debug("setParameterFromCommandLine end");
+  const int microsecond=(int)(1000000.0f/cycle_hz);
+  setOutputQueueBudget(cycle_hz);
+  setTickBudget(cycle_hz);
+
+  SerialLink links[MAX_LINKS];
+  ApiPort api;                          // used in xbee_api_mode only
+  int open_links=0;
+
+  // signals arrive through signalfd, SIGILL can't be blocked safely
+  int sigfd=createSignalFd();
+  if(sigfd<0)
+  {
+    fprintf(stderr,"[%s] %s:%u # signalfd: %s\n",__DATE__,__FILE__,__LINE__,strerror(errno));
+    return 1;
+  }
+  if (signal(SIGILL, signalHandler) == SIG_ERR)
+  {
+    printf("\ncan't catch SIGILL\n");
+  }
+  if(startTrace()<0)
+  {
+    fprintf(stderr,"[%s] %s:%u # trace %s: %s\n",__DATE__,__FILE__,__LINE__,trace_path,strerror(errno));
+    return 1;
+  }
+  if(startCapture()<0)
+  {
+    fprintf(stderr,"[%s] %s:%u # capture %s: %s\n",__DATE__,__FILE__,__LINE__,capture_path,strerror(errno));
+    return 1;
+  }
+  if(startMetrics()<0)
+  {
+    fprintf(stderr,"[%s] %s:%u # metrics port %d: %s\n",__DATE__,__FILE__,__LINE__,metrics_port,strerror(errno));
+    return 1;
+  }
+  if(shm_name!=NULL&&(shm_area=openShmCommandArea(shm_name,true))==NULL)
+  {
+    fprintf(stderr,"[%s] %s:%u # shm %s: %s\n",__DATE__,__FILE__,__LINE__,shm_name,strerror(errno));
+    return 1;
+  }
+
+  // initialize serial communication, in API mode every robot shares the coordinator port
+  for(int i=0;i<num_links;i++)
+  {
+    int fd=(xbee_api_mode&&i>0)?links[0].fd:openSerialPort(serial_ports[i],baud_rate,latency_timer_ms);
+    if(fd<0)
+    {
+      fprintf(stderr,"[%s] %s:%u # open %s: %s\n",__DATE__,__FILE__,__LINE__,serial_ports[i],strerror(errno));
+      return 1;
+    }
+    initSerialLink(&links[i],serial_ports[i],i,fd,microsecond/1000+1);
+  }
+  open_links=num_links;
+  if(xbee_api_mode)
+  {
+    initApiPort(&api,links[0].fd,microsecond/1000+1);
+  }
+
+  // writer thread inherits the blocked signal mask of this thread, it is
+  // started before the encoder is pinned so writer-cpu -1 means any CPU
+  if(pipeline_mode&&startPipeline(&pipeline,microsecond/1000+1)<0)
+  {
+    fprintf(stderr,"[%s] %s:%u # writer thread: %s\n",__DATE__,__FILE__,__LINE__,strerror(errno));
+    return 1;
+  }
+  applyThreadSettings("encoder",encoder_cpu,0);
+
+  PeriodicTimer timer;                // for realtime sequence
+  initCycleHistograms();
+  if(initPeriodicTimer(&timer,1000000000LL/cycle_hz,overrun_policy)<0)
+  {
+    fprintf(stderr,"[%s] %s:%u # timerfd: %s\n",__DATE__,__FILE__,__LINE__,strerror(errno));
+    return 1;
+  }
+
+  // multiplex transmit tick, received data of every port and signals on one thread
+  int epfd=epoll_create1(EPOLL_CLOEXEC);
+  if(epfd<0
+     ||addEpollFd(epfd,timer.fd,EPOLLIN)<0
+     ||addEpollFd(epfd,sigfd,EPOLLIN)<0)
+  {
+    fprintf(stderr,"[%s] %s:%u # epoll: %s\n",__DATE__,__FILE__,__LINE__,strerror(errno));
+    return 1;
+  }
+  for(int i=0;i<(xbee_api_mode?1:num_links);i++)
+  {
+    if(addEpollFd(epfd,links[i].fd,EPOLLIN)<0)
+    {
+      fprintf(stderr,"[%s] %s:%u # epoll %s: %s\n",__DATE__,__FILE__,__LINE__,links[i].port,strerror(errno));
+      return 1;
+    }
+  }
+
+  struct epoll_event events[MAX_LINKS+2];
+  struct signalfd_siginfo siginfo;
+  int64_t cycle_start=0,prev_start=0,late=0,cycles=0;
+  int64_t next_dump=getMonotonicNs();
+
+  while(!errorFlag)
+  {
+    int n=epoll_wait(epfd,events,sizeof(events)/sizeof(events[0]),-1);
+    if(n<0)
+    {
+      if(errno==EINTR)
+      {
+        continue;
+      }
+      fprintf(stderr,"[%s] %s:%u # epoll_wait: %s\n",__DATE__,__FILE__,__LINE__,strerror(errno));
+      break;
+    }
+
+    for(int e=0;e<n&&!errorFlag;e++)
+    {
+      int efd=events[e].data.fd;
+      if(efd==sigfd)
+      {
+        while(read(sigfd,&siginfo,sizeof(siginfo))==(ssize_t)sizeof(siginfo))
+        {
+          if(siginfo.ssi_signo==SIGHUP)
+          {
+            reloadConfig(&timer);
+            continue;
+          }
+          errorFlag=1;
+        }
+      }
+      else if(efd==timer.fd)
+      {
+        cycles=expirePeriodicTimer(&timer,&late);
+        if(cycles>0)
+        {
+          recordHistogram(&cycle_histogram[HIST_LATENESS],late);
+          recordMetric(&loop_metrics.lateness,late);
+        }
+        addMetric(&loop_metrics.cycles,cycles>0?(uint64_t)cycles:0);
+        setMetric(&loop_metrics.deadline_misses,timer.overruns);
+        setMetric(&loop_metrics.skipped_cycles,timer.skipped);
+        for(int64_t c=0;c<cycles&&!errorFlag;c++)
+        {
+          cycle_start=getMonotonicNs();
+          TRACE(TRACE_CYCLE,0xFFFF,c==0&&late>0?(uint32_t)std::min<int64_t>(late,UINT32_MAX):0,NULL,0);
+          if(prev_start!=0)
+          {
+            recordHistogram(&cycle_histogram[HIST_PERIOD],cycle_start-prev_start);
+          }
+          prev_start=cycle_start;
+
+        // every robot gets its commands in the same tick
+          if(pipeline_mode)
+          {
+            for(int i=0;i<num_links;i++)
+            {
+              int err=pipeline.write_error[i].exchange(0,std::memory_order_acquire);
+              if(err!=0&&(xbee_api_mode||links[i].fd>=0))
+              {
+                fprintf(stderr,"[%s] %s:%u # write error %s: %s\n",__DATE__,__FILE__,__LINE__,links[i].port,strerror(err));
+                if(xbee_api_mode)
+                {
+                  open_links=0;
+                  errorFlag=1;
+                  break;
+                }
+                closeSerialLink(epfd,&links[i]);
+                open_links--;
+              }
+            }
+            if(!errorFlag&&open_links>0)
+            {
+              submitCycle(&pipeline,links,num_links,xbee_api_mode?&api:NULL);
+            }
+          }
+          else if(xbee_api_mode)
+          {
+            if(transmitApiCycle(&api,links,num_links)<0)
+            {
+              fprintf(stderr,"[%s] %s:%u # write error %s: %s\n",__DATE__,__FILE__,__LINE__,links[0].port,strerror(errno));
+              open_links=0;
+              errorFlag=1;
+            }
+          }
+          else for(int i=0;i<num_links;i++)
+          {
+            if(links[i].fd>=0&&transmitCycle(&links[i])<0)
+            {
+              fprintf(stderr,"[%s] %s:%u # write error %s: %s\n",__DATE__,__FILE__,__LINE__,links[i].port,strerror(errno));
+              closeSerialLink(epfd,&links[i]);
+              open_links--;
+            }
+          }
+
+          loop_count++;
+          if(loop_count_enable&&loop_count>=loop_length)
+          {
+            printf("\nloopcount reach max\n");
+            errorFlag=1;
+          }
+        }
+        if(histogram_dump_interval<=0)
+        {
+          next_dump=getMonotonicNs();
+        }
+        else if(getMonotonicNs()>=next_dump+(int64_t)histogram_dump_interval*1000000000LL)
+        {
+          printCycleHistograms();
+          next_dump+=(int64_t)histogram_dump_interval*1000000000LL;
+        }
+      }
+      else if(xbee_api_mode)
+      {
+      // API frames from the coordinator
+        if(readApiAvailable(&api,links,num_links)<0
+           ||((events[e].events&(EPOLLERR|EPOLLHUP))&&(errno=EPIPE)))
+        {
+          fprintf(stderr,"[%s] %s:%u # read error %s: %s\n",__DATE__,__FILE__,__LINE__,links[0].port,strerror(errno));
+          open_links=0;
+        }
+      }
+      else
+      {
+      // decode whatever the robot has sent
+        for(int i=0;i<num_links;i++)
+        {
+          if(links[i].fd!=efd)
+          {
+            continue;
+          }
+          if(readAvailable(links[i].fd,&links[i].decoder)<0
+             ||((events[e].events&(EPOLLERR|EPOLLHUP))&&(errno=EPIPE)))
+          {
+            fprintf(stderr,"[%s] %s:%u # read error %s: %s\n",__DATE__,__FILE__,__LINE__,links[i].port,strerror(errno));
+            closeSerialLink(epfd,&links[i]);
+            open_links--;
+          }
+          break;
+        }
+      }
+      if(open_links==0)
+      {
+        fprintf(stderr,"[%s] %s:%u # no serial port left\n",__DATE__,__FILE__,__LINE__);
+        errorFlag=1;
+      }
+    }
+    debug("while loop end");
+  }
+
+  if(pipeline_mode)
+  {
+    stopPipeline(&pipeline);
+    printf("pipeline dropped %lu cycles\n",pipeline.dropped);
+  }
+  printf("overrun %lu times, skipped %lu cycles\n",timer.overruns,timer.skipped);
+  stopTrace();
+  stopCapture();
+  stopMetrics();
+  printCycleHistograms();
+  if(xbee_api_mode)
+  {
+    printApiStatistics(&api);
+  }
+  for(int i=0;i<num_links;i++)
+  {
+    printLinkStatistics(&links[i]);
+    printDecoderStatistics(&links[i].decoder);
+  }
+  if(shm_area!=NULL)
+  {
+    closeShmCommandArea(shm_area);    // not unlinked, an attached ROS node survives a restart
+  }
+  if(loop_count<loop_length)
+  {
     fprintf(stderr,"[%s] %s:%u # Exit with signal error\n",__DATE__,__FILE__,__LINE__);
   }
+  close(epfd);
+  close(timer.fd);
+  close(sigfd);
+  for(int i=0;i<(xbee_api_mode?1:num_links);i++)
+  {
+    close(links[i].device_fd);
+  }
   return 0;
 }
+#endif
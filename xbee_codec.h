@@ -0,0 +1,727 @@
+/**
+ * @file xbee_codec.h
+ *
+ * @brief Framing codec of usbserial-xbee, header only
+ * @detail Wire format, payload packers, escape/checksum kernels, frame
+ *         encoder and streaming decoder. Everything works on caller
+ *         buffers (pointer and length, ByteBuffer or ByteSpan), nothing
+ *         allocates, does I/O or keeps global state, so the ROS node, a
+ *         test harness and the robot-side simulator can include it as is.
+ *         Serial ports are in xbee_transport.h.
+**/
+#ifndef XBEE_CODEC_H
+#define XBEE_CODEC_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)&&defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+const uint8_t HEAD_BYTE  =0x7D;
+const uint8_t ESCAPE_BYTE=0x7E;
+const uint8_t ESCAPE_MASK=0x20;
+constexpr int MAX_DATA_TYPE=3;                         // command datatypes 0-2: vector, calib, kicker
+constexpr size_t MAX_PAYLOAD_SIZE=5;                   // unit : Bytes, datatype 0
+constexpr size_t MAX_CHECK_SIZE=2;                     // unit : Bytes, CRC-16 of frame version 2
+constexpr size_t MAX_FRAME_SIZE=1+2*MAX_PAYLOAD_SIZE+2*MAX_CHECK_SIZE; // header + escaped payload + escaped checksum
+constexpr size_t TX_BUFFER_SIZE=MAX_FRAME_SIZE*(MAX_DATA_TYPE+1);     // every datatype + hello frame
+constexpr size_t MAX_RECORDS_SIZE=1+MAX_PAYLOAD_SIZE*MAX_DATA_TYPE;   // multi-record header + every datatype
+
+/* @ByteBuffer
+ * @brief Fixed-capacity byte container which never touches the heap
+ * @detail Capacity is the worst case known at compile time, so push_back()
+ *         doesn't check bounds. Reuse it with clear() every cycle.
+ */
+template<size_t N>
+struct ByteBuffer
+{
+  uint8_t data[N];
+  size_t size;
+
+  ByteBuffer():size(0) {}
+  static constexpr size_t capacity() { return N; }
+  void clear() { size=0; }
+  void push_back(uint8_t byte) { data[size++]=byte; }
+  const uint8_t *begin() const { return data; }
+  const uint8_t *end() const { return data+size; }
+};
+typedef ByteBuffer<MAX_PAYLOAD_SIZE> Payload;   // packed data of one datatype
+typedef ByteBuffer<TX_BUFFER_SIZE> TxBuffer;    // escaped frames of one cycle
+typedef ByteBuffer<MAX_RECORDS_SIZE> RecordBuffer;  // payload of a multi-record frame
+/* @ByteSpan
+ * @brief Read-only view of caller bytes, e.g. a received chunk
+ */
+struct ByteSpan
+{
+  const uint8_t *data;
+  size_t size;
+};
+
+/*
+ * data set 0 (datatype=0, velocity vector)
+ * | 0-7(8) | 8-10(3) | 11-22(12) | 23-34(12) | 35(1) | 36-47(12) | 48-55(8) |
+ * |--------|---------|-----------|-----------|-------|-----------|----------|
+ * |HEADER  |DATATYPE |X_VECTOR   |Y_VECTOR   |0      |TH_VECTOR  |CHECKSUM  |
+ * |--------|---------|-----------|-----------|-------|-----------|----------|
+ *
+ * data set 1 (datatype=1, rotation calibration)
+ * | 0-7(8) | 8-10(3) | 11-23(13) | 23-30(8) |
+ * |--------|---------|-----------|----------|
+ * |HEADER  |DATATYPE |CALIB_DATA | CHECKSUM |
+ * |--------|---------|-----------|----------|
+ *
+ * data set 2 (datatype=2, kicker command & robot states)
+ * | 0-7(8) | 8-10(3) | 11-15(5)  | 16-23(8) |
+ * |--------|---------|-----------|----------|
+ * |HEADER  |DATATYPE |COMMAND    |CHECKSUM  |
+ * |--------|---------|-----------|----------|
+ *
+ * data set 3 (datatype=3, robot select, XBee API broadcast only)
+ * | 0-7(8) | 8-10(3) | 11-15(5)  | 16-23(8) |
+ * |--------|---------|-----------|----------|
+ * |HEADER  |DATATYPE |ROBOT_ID   |CHECKSUM  |
+ * |--------|---------|-----------|----------|
+ * The following frames of the same RF packet are for ROBOT_ID only.
+ *
+ * data set 4 (datatype=4, velocity delta, VECTOR_DELTA only)
+ * | 0-7(8) | 8-10(3) | 11-14(4)  | 15-18(4)  | 19-22(4)  | 23(1) | 24-31(8) |
+ * |--------|---------|-----------|-----------|-----------|-------|----------|
+ * |HEADER  |DATATYPE |X_DELTA    |Y_DELTA    |TH_DELTA   |0      |CHECKSUM  |
+ * |--------|---------|-----------|-----------|-----------|-------|----------|
+ *
+ * data set 5 (datatype=5, velocity delta, VECTOR_DELTA only)
+ * | 0-7(8) | 8-10(3) | 11-17(7)  | 18-24(7)  | 25-31(7)  | 32-39(8) |
+ * |--------|---------|-----------|-----------|-----------|----------|
+ * |HEADER  |DATATYPE |X_DELTA    |Y_DELTA    |TH_DELTA   |CHECKSUM  |
+ * |--------|---------|-----------|-----------|-----------|----------|
+ * Deltas are two's complement and are added to the last vector modulo
+ * 4096. A datatype 0 frame is the keyframe which resets that vector.
+ *
+ * data set 1/2 with RELIABLE_DELIVERY
+ * | 0-7(8) | 8-10(3) | 11-23(13)  | 24-31(8) | 32-39(8) |
+ * |--------|---------|------------|----------|----------|
+ * |HEADER  |DATATYPE |CALIB_DATA  |SEQ       |CHECKSUM  |
+ * |--------|---------|------------|----------|----------|
+ * | 0-7(8) | 8-10(3) | 11-15(5)   | 16-23(8) | 24-31(8) |
+ * |--------|---------|------------|----------|----------|
+ * |HEADER  |DATATYPE |COMMAND     |SEQ       |CHECKSUM  |
+ * |--------|---------|------------|----------|----------|
+ * SEQ counts per datatype. The robot acts on a SEQ once and ACKs every
+ * copy it receives, so a retransmit after a lost ACK is harmless.
+ *
+ * data set 3 (datatype=3, ACK, robot -> host, RELIABLE_DELIVERY only)
+ * | 0-7(8) | 8-10(3) | 11-13(3)  | 14-15(2) | 16-23(8) | 24-31(8) |
+ * |--------|---------|-----------|----------|----------|----------|
+ * |HEADER  |DATATYPE |DATATYPE   |0         |SEQ       |CHECKSUM  |
+ * |--------|---------|-----------|----------|----------|----------|
+ *
+ * data set 6 (datatype=6, resync request, robot -> host)
+ * | 0-7(8) | 8-10(3) | 11-13(3)  | 14-15(2) | 16-23(8) |
+ * |--------|---------|-----------|----------|----------|
+ * |HEADER  |DATATYPE |DATATYPE   |0         |CHECKSUM  |
+ * |--------|---------|-----------|----------|----------|
+ * The robot lost a frame of DATATYPE: it is sent in the next cycle, a
+ * velocity request (0) is answered with a keyframe.
+ *
+ * data set 6 (datatype=6, multi-record, host -> robot, MULTI_RECORD only)
+ * | 0-7(8) | 8-10(3) | 11-15(5)  | 16-(8*n)   | (8)      |
+ * |--------|---------|-----------|------------|----------|
+ * |HEADER  |DATATYPE |COUNT      |RECORD * n  |CHECKSUM  |
+ * |--------|---------|-----------|------------|----------|
+ * Each RECORD is the payload of one of data set 0-5 as is; its own
+ * datatype gives its size. The whole frame has one header and checksum.
+ *
+ * data set 7 (datatype=7, hello, FRAME_VERSION 0 only)
+ * | 0-7(8) | 8-10(3) | 11-15(5)  | 16-23(8) |
+ * |--------|---------|-----------|----------|
+ * |HEADER  |DATATYPE |VERSION    |CHECKSUM  |
+ * |--------|---------|-----------|----------|
+ * Host offers the highest frame version it knows, the robot answers with
+ * the highest one it knows. Hello is always a version 1 frame.
+ *
+ * frame version 2
+ * CHECKSUM is replaced by a CRC-16 (2 bytes, MSB first, each escaped)
+ * over the payload before escape. Version 1 sums bytes after escape mask
+ * in 8 bits, which misses swapped bytes and many double errors.
+ */
+
+struct VectorData
+{
+  uint16_t x_vector,y_vector,th_vector;
+};
+
+// one consistent set of values for one transmit cycle
+struct RobotCommand
+{
+  VectorData vector;
+  uint16_t calib_data;
+  uint16_t command;
+};
+
+/*
+ * Frame schema
+ * FrameSchema<DATATYPE,width...> describes the payload of one datatype as
+ * a list of field widths packed MSB first right after the 3-bit datatype.
+ * pack() and unpack() are generated from the list, so the compiler
+ * specializes each datatype into straight shift code. To add datatype
+ * 3-7, add a typedef and a case in setSendDataFromROSBus().
+ * The whole payload must fit in 64 bits and in MAX_PAYLOAD_SIZE bytes.
+ */
+const unsigned DATATYPE_BITS=3;
+
+template<unsigned... Widths> struct WidthSum;
+template<> struct WidthSum<> { static constexpr unsigned value=0; };
+template<unsigned W,unsigned... Rest> struct WidthSum<W,Rest...>
+{
+  static constexpr unsigned value=W+WidthSum<Rest...>::value;
+};
+
+template<uint8_t DataType,unsigned... Widths>
+struct FrameSchema
+{
+  static constexpr uint8_t datatype=DataType;
+  static constexpr size_t field_count=sizeof...(Widths);
+  static constexpr unsigned bits=DATATYPE_BITS+WidthSum<Widths...>::value;
+  static constexpr size_t payload_size=(bits+7)/8;
+  static_assert(DataType<(1<<DATATYPE_BITS),"datatype must fit in 3 bits");
+  static_assert(bits<=64,"payload must fit in 64 bits");
+  static_assert(payload_size<=MAX_PAYLOAD_SIZE,"payload exceeds MAX_PAYLOAD_SIZE");
+
+  static inline uint64_t mask(unsigned width) { return (1ULL<<width)-1; }
+
+  // values[] in the order of Widths, each masked to its width
+  static inline void pack(const uint32_t (&values)[field_count],Payload *buf)
+  {
+    uint64_t acc=DataType;
+    size_t i=0;
+    int expand[]={0,((acc=(acc<<Widths)|(values[i++]&mask(Widths))),0)...};
+    (void)expand;
+    acc<<=payload_size*8-bits;
+    for(size_t b=0;b<payload_size;b++)
+    {
+      buf->push_back((uint8_t)(acc>>((payload_size-1-b)*8)));
+    }
+  }
+
+  // in must hold payload_size bytes, returns datatype field of in
+  static inline uint8_t unpack(const uint8_t *in,uint32_t (&values)[field_count])
+  {
+    uint64_t acc=0;
+    unsigned pos=payload_size*8-DATATYPE_BITS;
+    size_t i=0;
+    for(size_t b=0;b<payload_size;b++)
+    {
+      acc=(acc<<8)|in[b];
+    }
+    int expand[]={0,((values[i++]=(uint32_t)((acc>>(pos-=Widths))&mask(Widths))),0)...};
+    (void)expand;
+    return (uint8_t)(acc>>(payload_size*8-DATATYPE_BITS));
+  }
+};
+
+typedef FrameSchema<0,12,12,1,12> VectorSchema;   // X_VECTOR,Y_VECTOR,(always 0),TH_VECTOR
+typedef FrameSchema<1,13> CalibSchema;            // CALIB_DATA
+typedef FrameSchema<2,5> KickerSchema;            // COMMAND
+typedef FrameSchema<3,5> RobotSelectSchema;       // ROBOT_ID, host -> robot
+typedef FrameSchema<3,3,2,8> AckSchema;           // DATATYPE,(always 0),SEQ, robot -> host
+typedef FrameSchema<1,13,8> ReliableCalibSchema;  // CALIB_DATA,SEQ
+typedef FrameSchema<2,5,8> ReliableKickerSchema;  // COMMAND,SEQ
+typedef FrameSchema<4,4,4,4,1> VectorDelta2Schema; // X_DELTA,Y_DELTA,TH_DELTA,(always 0)
+typedef FrameSchema<5,7,7,7> VectorDelta3Schema;  // X_DELTA,Y_DELTA,TH_DELTA
+typedef FrameSchema<6,3,2> NackSchema;            // DATATYPE,(always 0), robot -> host
+typedef FrameSchema<6,5> MultiRecordSchema;       // COUNT, host -> robot
+typedef FrameSchema<7,5> HelloSchema;             // VERSION
+
+/* @setSendDataFromROSBus
+ * @brief Split and store sending data in payload buffer
+ * @param[in] cmd Snapshot taken by loadRobotCommand()
+ * @param[out] buf Payload buffer. Each data must be split in 1byte(=8bit) data.
+ * @detail This function doesn't add header and checksum data.
+ */
+
+inline void setSendDataFromROSBus(uint8_t datatype,const RobotCommand &cmd,Payload *buf){
+  switch(datatype)
+  {
+    case VectorSchema::datatype:
+    {
+      const uint32_t values[]={cmd.vector.x_vector,cmd.vector.y_vector,0,cmd.vector.th_vector};
+      VectorSchema::pack(values,buf);
+      break;
+    }
+    case CalibSchema::datatype:
+    {
+      const uint32_t values[]={cmd.calib_data};
+      CalibSchema::pack(values,buf);
+      break;
+    }
+    case KickerSchema::datatype:
+    {
+      const uint32_t values[]={cmd.command};
+      KickerSchema::pack(values,buf);
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+/*
+ * Escape and checksum kernels
+ * Copy in[] to out[] with HEAD_BYTE/ESCAPE_BYTE escaped and add every
+ * byte after escape mask to *sum. The vector kernel checks 16 bytes at
+ * once: a chunk without special bytes is stored as is and summed with
+ * one SAD (SSE2) or add-across (NEON); other chunks and the tail go
+ * through the scalar kernel, so the output is bit-exact with it.
+ * out must have 2*len bytes free.
+ */
+inline size_t escapeAndSumScalar(const uint8_t *in,size_t len,uint8_t *out,uint32_t *sum)
+{
+  size_t n=0;
+  uint8_t tmp=0;
+  for(size_t i=0;i<len;i++)
+  {
+    tmp=in[i];
+  // if data compete with HEAD_BYTE or ESCAPE_BYTE, run escape sequence
+    if(tmp==HEAD_BYTE||tmp==ESCAPE_BYTE)
+    {
+      out[n++]=ESCAPE_BYTE;
+      tmp^=ESCAPE_MASK;
+    }
+    out[n++]=tmp;
+    *sum+=tmp;
+  }
+  return n;
+}
+
+#if defined(__SSE2__)
+#define ESCAPE_KERNEL "sse2"
+inline size_t escapeAndSumVector(const uint8_t *in,size_t len,uint8_t *out,uint32_t *sum)
+{
+  const __m128i head=_mm_set1_epi8((char)HEAD_BYTE);
+  const __m128i escape=_mm_set1_epi8((char)ESCAPE_BYTE);
+  const __m128i zero=_mm_setzero_si128();
+  __m128i acc=_mm_setzero_si128();      // two 64-bit partial sums
+  size_t i=0,n=0;
+
+  for(;i+16<=len;i+=16)
+  {
+    __m128i v=_mm_loadu_si128((const __m128i*)(in+i));
+    __m128i special=_mm_or_si128(_mm_cmpeq_epi8(v,head),_mm_cmpeq_epi8(v,escape));
+    if(_mm_movemask_epi8(special)==0)
+    {
+      _mm_storeu_si128((__m128i*)(out+n),v);
+      acc=_mm_add_epi64(acc,_mm_sad_epu8(v,zero));
+      n+=16;
+    }
+    else
+    {
+      n+=escapeAndSumScalar(in+i,16,out+n,sum);
+    }
+  }
+  *sum+=(uint32_t)(_mm_cvtsi128_si32(acc)+_mm_cvtsi128_si32(_mm_unpackhi_epi64(acc,acc)));
+  return n+escapeAndSumScalar(in+i,len-i,out+n,sum);
+}
+#elif defined(__ARM_NEON)&&defined(__aarch64__)
+#define ESCAPE_KERNEL "neon"
+inline size_t escapeAndSumVector(const uint8_t *in,size_t len,uint8_t *out,uint32_t *sum)
+{
+  const uint8x16_t head=vdupq_n_u8(HEAD_BYTE);
+  const uint8x16_t escape=vdupq_n_u8(ESCAPE_BYTE);
+  size_t i=0,n=0;
+
+  for(;i+16<=len;i+=16)
+  {
+    uint8x16_t v=vld1q_u8(in+i);
+    uint8x16_t special=vorrq_u8(vceqq_u8(v,head),vceqq_u8(v,escape));
+    if(vmaxvq_u8(special)==0)
+    {
+      vst1q_u8(out+n,v);
+      *sum+=vaddlvq_u8(v);
+      n+=16;
+    }
+    else
+    {
+      n+=escapeAndSumScalar(in+i,16,out+n,sum);
+    }
+  }
+  return n+escapeAndSumScalar(in+i,len-i,out+n,sum);
+}
+#else
+#define ESCAPE_KERNEL "scalar"
+inline size_t escapeAndSumVector(const uint8_t *in,size_t len,uint8_t *out,uint32_t *sum)
+{
+  return escapeAndSumScalar(in,len,out,sum);
+}
+#endif
+
+/*
+ * Frame version 2 check
+ * CRC-16/CCITT-FALSE (poly 0x1021, init 0xFFFF) over the payload before
+ * escape, table driven one byte per step. escapeAndCrc() updates the CRC
+ * while it escapes, so the payload is read once. Payloads are at most
+ * MAX_PAYLOAD_SIZE bytes, too short for slice-by-4 to pay for its tables.
+ */
+enum FrameVersion
+{
+  FRAME_V1=1,         // 8-bit sum after escape mask
+  FRAME_V2=2          // CRC-16 before escape
+};
+const int MAX_FRAME_VERSION=FRAME_V2;
+
+struct Crc16Table
+{
+  uint16_t entry[256];
+
+  Crc16Table()
+  {
+    for(int i=0;i<256;i++)
+    {
+      uint16_t crc=(uint16_t)(i<<8);
+      for(int bit=0;bit<8;bit++)
+      {
+        crc=(crc&0x8000)?(uint16_t)((crc<<1)^0x1021):(uint16_t)(crc<<1);
+      }
+      entry[i]=crc;
+    }
+  }
+};
+const Crc16Table crc16_table;
+const uint16_t CRC16_INIT=0xFFFF;
+
+inline uint16_t updateCrc16(uint16_t crc,uint8_t byte)
+{
+  return (uint16_t)((crc<<8)^crc16_table.entry[(crc>>8)^byte]);
+}
+
+inline size_t escapeAndCrc(const uint8_t *in,size_t len,uint8_t *out,uint16_t *crc)
+{
+  size_t n=0;
+  uint8_t tmp=0;
+  for(size_t i=0;i<len;i++)
+  {
+    tmp=in[i];
+    *crc=updateCrc16(*crc,tmp);
+    if(tmp==HEAD_BYTE||tmp==ESCAPE_BYTE)
+    {
+      out[n++]=ESCAPE_BYTE;
+      tmp^=ESCAPE_MASK;
+    }
+    out[n++]=tmp;
+  }
+  return n;
+}
+
+inline size_t putEscapedByte(uint8_t byte,uint8_t *out)
+{
+  if(byte==HEAD_BYTE||byte==ESCAPE_BYTE)
+  {
+    out[0]=ESCAPE_BYTE;
+    out[1]=byte^ESCAPE_MASK;
+    return 2;
+  }
+  out[0]=byte;
+  return 1;
+}
+
+/* @encodeFrame
+ * @brief Write one escaped frame (HEAD_BYTE, payload, checksum) of any length
+ * @param[out] out Must have 1+2*len+2*MAX_CHECK_SIZE bytes free.
+ * @param[in] version FRAME_V1 or FRAME_V2, decides the check bytes
+ * @return Number of bytes written to out
+ * @detail The checksum is the low byte of the sum of HEAD_BYTE and every
+ *         payload byte after escape mask, same as the original per-byte loop.
+ *         Payloads shorter than one vector go straight to the scalar kernel.
+ */
+inline size_t encodeFrame(const uint8_t *payload,size_t len,uint8_t *out,int version)
+{
+  uint32_t checksum=HEAD_BYTE;
+  uint16_t crc=CRC16_INIT;
+  size_t n=0;
+
+  out[n++]=HEAD_BYTE;
+  if(version==FRAME_V2)
+  {
+    n+=escapeAndCrc(payload,len,out+n,&crc);
+    n+=putEscapedByte((uint8_t)(crc>>8),out+n);
+    n+=putEscapedByte((uint8_t)(crc&0xFF),out+n);
+  }
+  else
+  {
+    if(len<16)
+    {
+      n+=escapeAndSumScalar(payload,len,out+n,&checksum);
+    }
+    else
+    {
+      n+=escapeAndSumVector(payload,len,out+n,&checksum);
+    }
+    n+=putEscapedByte((uint8_t)(checksum&0xFF),out+n);
+  }
+  return n;
+}
+
+/* @encodeFrame
+ * @brief Append one escaped frame (HEAD_BYTE, payload, checksum) to out
+ * @param[in] payload Packed data made by setSendDataFromROSBus()
+ * @param[out] out Transmit buffer. It must have MAX_FRAME_SIZE bytes free.
+ * @return Number of bytes appended to out
+ */
+inline size_t encodeFrame(const Payload &payload,uint8_t *out,int version)
+{
+  return encodeFrame(payload.data,payload.size,out,version);
+}
+
+inline void encodeFrame(const Payload &payload,TxBuffer *out,int version)
+{
+  out->size+=encodeFrame(payload,out->data+out->size,version);
+}
+
+/* @encodeFrame
+ * @brief Bounds-checked encodeFrame() into out[0..capacity)
+ * @return Number of bytes written, 0 if the worst case doesn't fit
+ */
+inline size_t encodeFrame(ByteSpan payload,uint8_t *out,size_t capacity,int version)
+{
+  if(capacity<1+2*payload.size+2*MAX_CHECK_SIZE)
+  {
+    return 0;
+  }
+  return encodeFrame(payload.data,payload.size,out,version);
+}
+
+/*
+ * Streaming frame decoder
+ * Parses HEAD_BYTE/ESCAPE_BYTE framed data from read() chunks of any size.
+ * There is no length byte on the wire, so the payload size comes from the
+ * datatype in the first payload byte (payload_size[] table). A raw
+ * HEAD_BYTE never appears inside a frame, so any HEAD_BYTE starts a new
+ * frame; that is how the decoder resynchronizes after corruption.
+ * The checksum is checked the same way encodeFrame() builds it: version
+ * is the frame version of the link, hello frames are always version 1.
+ * Datatype 6 means resync request from a robot and multi-record frame
+ * from the host; a decoder of host frames sets multi_record, and then
+ * handler is called once per record of a valid multi-record frame.
+ * Datatype 3 is ACK from a robot and robot select from the host; robot
+ * select is always version 1 too, every robot of the broadcast parses it.
+ */
+typedef void (*FrameHandler)(const uint8_t *payload,size_t len,void *user);
+
+enum DecoderState
+{
+  DECODE_WAIT_HEAD,   // discarding bytes until HEAD_BYTE
+  DECODE_PAYLOAD,     // collecting payload bytes
+  DECODE_CHECKSUM     // next byte is checksum
+};
+
+struct FrameDecoder
+{
+  int state;
+  bool escaped;                 // previous byte was ESCAPE_BYTE
+  int version;                  // FrameVersion expected from the robot
+  int checksum;
+  uint16_t crc;
+  size_t expected;              // payload bytes known so far, the frame or record ends there
+  size_t records_left;          // multi-record: records whose first byte is still to come
+  size_t check_size;            // check bytes of current frame
+  size_t check_count;           // check bytes received
+  uint16_t check;
+  bool multi_record;            // datatype 6 is a multi-record frame (decoding host frames)
+  RecordBuffer payload;
+  uint8_t payload_size[1<<DATATYPE_BITS];  // 0 means unknown datatype
+  FrameHandler handler;
+  void *user;
+  // statistics
+  unsigned long frames;
+  unsigned long checksum_errors;
+  unsigned long broken_frames;  // HEAD_BYTE or bad escape in the middle of a frame
+  unsigned long unknown_types;
+  unsigned long dropped_bytes;  // bytes discarded while waiting HEAD_BYTE
+};
+
+inline void initFrameDecoder(FrameDecoder *dec,FrameHandler handler,void *user)
+{
+  memset(dec->payload_size,0,sizeof(dec->payload_size));
+  dec->payload_size[VectorSchema::datatype]=VectorSchema::payload_size;
+  dec->payload_size[CalibSchema::datatype]=CalibSchema::payload_size;
+  dec->payload_size[KickerSchema::datatype]=KickerSchema::payload_size;
+  dec->payload_size[RobotSelectSchema::datatype]=RobotSelectSchema::payload_size;
+  dec->payload_size[VectorDelta2Schema::datatype]=VectorDelta2Schema::payload_size;
+  dec->payload_size[VectorDelta3Schema::datatype]=VectorDelta3Schema::payload_size;
+  dec->payload_size[NackSchema::datatype]=NackSchema::payload_size;
+  dec->payload_size[HelloSchema::datatype]=HelloSchema::payload_size;
+  dec->state=DECODE_WAIT_HEAD;
+  dec->escaped=false;
+  dec->version=FRAME_V1;
+  dec->checksum=0;
+  dec->crc=CRC16_INIT;
+  dec->expected=0;
+  dec->records_left=0;
+  dec->check_size=0;
+  dec->check_count=0;
+  dec->check=0;
+  dec->multi_record=false;
+  dec->payload.clear();
+  dec->handler=handler;
+  dec->user=user;
+  dec->frames=0;
+  dec->checksum_errors=0;
+  dec->broken_frames=0;
+  dec->unknown_types=0;
+  dec->dropped_bytes=0;
+}
+
+/* @setDecoderPayloadSize
+ * @brief Register payload size of an inbound datatype
+ * @return 0 on success, -1 if datatype or size is out of range
+ */
+inline int setDecoderPayloadSize(FrameDecoder *dec,uint8_t datatype,size_t size)
+{
+  if(datatype>=(1<<DATATYPE_BITS)||size>Payload::capacity())
+  {
+    return -1;
+  }
+  dec->payload_size[datatype]=(uint8_t)size;
+  return 0;
+}
+
+inline void startFrame(FrameDecoder *dec)
+{
+  dec->state=DECODE_PAYLOAD;
+  dec->escaped=false;
+  dec->checksum=HEAD_BYTE;
+  dec->crc=CRC16_INIT;
+  dec->expected=0;
+  dec->records_left=0;
+  dec->check_count=0;
+  dec->check=0;
+  dec->payload.clear();
+}
+
+/* @feedFrameDecoder
+ * @brief Decode a chunk of received bytes
+ * @detail handler is called for every frame whose checksum matches.
+ *         Partial frames are kept until the next call.
+ */
+inline void feedFrameDecoder(FrameDecoder *dec,const uint8_t *data,size_t len)
+{
+  uint8_t wire=0,value=0;
+
+  for(size_t i=0;i<len;i++)
+  {
+    wire=data[i];
+    if(wire==HEAD_BYTE)
+    {
+      if(dec->state!=DECODE_WAIT_HEAD)
+      {
+        dec->broken_frames++;
+      }
+      startFrame(dec);
+      continue;
+    }
+    if(dec->state==DECODE_WAIT_HEAD)
+    {
+      dec->dropped_bytes++;
+      continue;
+    }
+    if(dec->escaped)
+    {
+      dec->escaped=false;
+      value=wire^ESCAPE_MASK;
+      if(value!=HEAD_BYTE&&value!=ESCAPE_BYTE)
+      {
+      // encodeFrame() escapes nothing else, resync at the next HEAD_BYTE
+        dec->broken_frames++;
+        dec->state=DECODE_WAIT_HEAD;
+        continue;
+      }
+    }
+    else if(wire==ESCAPE_BYTE)
+    {
+      dec->escaped=true;
+      continue;
+    }
+    else
+    {
+      value=wire;
+    }
+
+    if(dec->state==DECODE_PAYLOAD)
+    {
+      if(dec->payload.size==dec->expected)
+      {
+      // first byte of the frame or of the next record carries its datatype
+        const uint8_t type=value>>(8-DATATYPE_BITS);
+        const bool header=dec->payload.size==0;
+        size_t size=dec->payload_size[type];
+        if(dec->multi_record&&type==MultiRecordSchema::datatype)
+        {
+          size=header&&(value&0x1F)>0?1:0;    // no nesting, no empty frame
+        }
+        if(size==0||(!header&&type==HelloSchema::datatype)||dec->expected+size>RecordBuffer::capacity())
+        {
+          dec->unknown_types++;
+          dec->state=DECODE_WAIT_HEAD;
+          continue;
+        }
+        if(header)
+        {
+          dec->check_size=(dec->version==FRAME_V2&&type!=HelloSchema::datatype
+                           &&!(dec->multi_record&&type==RobotSelectSchema::datatype))?2:1;
+          dec->records_left=dec->multi_record&&type==MultiRecordSchema::datatype?(value&0x1F):0;
+        }
+        else
+        {
+          dec->records_left--;
+        }
+        dec->expected+=size;
+      }
+      dec->payload.push_back(value);
+      dec->checksum+=wire;    // encodeFrame() sums bytes after escape mask
+      dec->crc=updateCrc16(dec->crc,value);
+      if(dec->payload.size==dec->expected&&dec->records_left==0)
+      {
+        dec->state=DECODE_CHECKSUM;
+      }
+    }
+    else
+    {
+      dec->check=(uint16_t)((dec->check<<8)|value);
+      if(++dec->check_count<dec->check_size)
+      {
+        continue;
+      }
+      if(dec->check_size==2?dec->check==dec->crc:dec->check==(dec->checksum&0xFF))
+      {
+        dec->frames++;
+        if(dec->handler!=NULL&&dec->multi_record&&(dec->payload.data[0]>>(8-DATATYPE_BITS))==MultiRecordSchema::datatype)
+        {
+          for(size_t p=1,n=0;p<dec->payload.size;p+=n)
+          {
+            n=dec->payload_size[dec->payload.data[p]>>(8-DATATYPE_BITS)];
+            dec->handler(dec->payload.data+p,n,dec->user);
+          }
+        }
+        else if(dec->handler!=NULL)
+        {
+          dec->handler(dec->payload.data,dec->payload.size,dec->user);
+        }
+      }
+      else
+      {
+        dec->checksum_errors++;
+      }
+      dec->state=DECODE_WAIT_HEAD;
+    }
+  }
+}
+
+inline void feedFrameDecoder(FrameDecoder *dec,ByteSpan data)
+{
+  feedFrameDecoder(dec,data.data,data.size);
+}
+
+#endif // XBEE_CODEC_H
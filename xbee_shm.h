@@ -0,0 +1,226 @@
+/**
+ * @file xbee_shm.h
+ *
+ * @brief Shared-memory command rings between a ROS node and usbserial-xbee
+ * @detail usbserial-xbee --shm NAME creates the POSIX shared memory object
+ *         NAME with one single-producer/single-consumer ring per robot. A
+ *         ROS node (or nodelet) attaches with create=false and pushes each
+ *         command as it arrives; the serial loop drains every ring at the
+ *         start of a tick. Nothing is serialized or copied through a
+ *         socket, a command costs two cache lines. A full ring drops the
+ *         new command and counts it, the producer never waits. Every
+ *         SHM_COMMAND push is one kick: a kick the serial loop can't queue
+ *         yet stays in the ring, so kicks are only lost to `dropped`.
+ *         Only one thread may push to the ring of a robot, and only one
+ *         usbserial-xbee may consume the rings (a second one gets EBUSY).
+ *         The object outlives usbserial-xbee, rm /dev/shm/NAME drops it.
+**/
+#ifndef XBEE_SHM_H
+#define XBEE_SHM_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <atomic>
+#include "xbee_codec.h"
+
+#define XBEE_SHM_MAX_ROBOTS 8
+#define XBEE_SHM_RING_SIZE 64         // commands per robot, power of two
+
+const uint32_t XBEE_SHM_MAGIC=0x48534258;   // "XBSH"
+const uint32_t XBEE_SHM_VERSION=1;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE==2,"ring indexes must be lock-free to work across processes");
+
+enum ShmCommandField
+{
+  SHM_VECTOR=1<<0,                    // vector is valid
+  SHM_CALIB=1<<1,                     // calib_data is valid
+  SHM_COMMAND=1<<2                    // command is valid, each push is one more kick
+};
+
+// one message of the ROS node, fields not in `fields` keep their last value
+struct ShmCommand
+{
+  uint32_t fields;                    // ShmCommandField bits
+  VectorData vector;
+  uint16_t calib_data;
+  uint16_t command;
+  int64_t stamp_ns;                   // CLOCK_MONOTONIC when published
+};
+
+struct ShmCommandRing
+{
+  alignas(64) std::atomic<uint64_t> head;   // written by the producer
+  std::atomic<uint64_t> dropped;            // pushes into a full ring
+  alignas(64) std::atomic<uint64_t> tail;   // written by usbserial-xbee
+  ShmCommand slot[XBEE_SHM_RING_SIZE];
+};
+
+struct ShmCommandArea
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t robots;
+  uint32_t ring_size;
+  ShmCommandRing ring[XBEE_SHM_MAX_ROBOTS];
+};
+
+// fd of the area usbserial-xbee consumes, its flock() marks the consumer alive
+inline int &shmConsumerLock()
+{
+  static int fd=-1;
+  return fd;
+}
+
+/* @openShmCommandArea
+ * @brief Map the command rings of name ("/xbee" style)
+ * @param[in] create true takes the consumer side (usbserial-xbee),
+ *            creating the rings if needed; false attaches to existing ones
+ *            (producer)
+ * @return Mapped area, NULL on error (errno is set, EPROTO for a layout
+ *         of another version, EBUSY if another consumer holds the rings)
+ * @detail A consumer finding rings of this layout keeps them, so a ROS
+ *         node attached to them goes on working across a restart; only
+ *         commands queued before the restart are skipped. Otherwise magic
+ *         is cleared before the rings are reset and set last, so a
+ *         producer attaching meanwhile gets EPROTO, not half a layout.
+ */
+inline ShmCommandArea *openShmCommandArea(const char *name,bool create)
+{
+  bool fresh=create;
+  int fd=shm_open(name,create?O_RDWR|O_CREAT|O_EXCL:O_RDWR,0660);
+  if(fd<0&&create&&errno==EEXIST)
+  {
+    fresh=false;
+    fd=shm_open(name,O_RDWR,0660);
+  }
+  if(fd<0)
+  {
+    return NULL;
+  }
+  struct stat st;
+  if(create&&(flock(fd,LOCK_EX|LOCK_NB)<0||fstat(fd,&st)<0
+              ||((size_t)st.st_size<sizeof(ShmCommandArea)&&ftruncate(fd,sizeof(ShmCommandArea))<0)))
+  {
+    errno=errno==EWOULDBLOCK?EBUSY:errno;
+    close(fd);
+    return NULL;
+  }
+  void *p=mmap(NULL,sizeof(ShmCommandArea),PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+  if(p==MAP_FAILED)
+  {
+    close(fd);
+    return NULL;
+  }
+  ShmCommandArea *area=(ShmCommandArea*)p;
+  const bool valid=area->magic==XBEE_SHM_MAGIC&&area->version==XBEE_SHM_VERSION
+                   &&area->ring_size==XBEE_SHM_RING_SIZE;
+  if(!create)
+  {
+    close(fd);
+    if(!valid)
+    {
+      munmap(p,sizeof(ShmCommandArea));
+      errno=EPROTO;
+      return NULL;
+    }
+    return area;
+  }
+  if(!fresh&&valid)
+  {
+    for(int i=0;i<XBEE_SHM_MAX_ROBOTS;i++)
+    {
+      area->ring[i].tail.store(area->ring[i].head.load(std::memory_order_acquire),std::memory_order_release);
+    }
+  }
+  else
+  {
+    area->magic=0;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    for(int i=0;i<XBEE_SHM_MAX_ROBOTS;i++)
+    {
+      area->ring[i].head.store(0,std::memory_order_relaxed);
+      area->ring[i].tail.store(0,std::memory_order_relaxed);
+      area->ring[i].dropped.store(0,std::memory_order_relaxed);
+    }
+    area->version=XBEE_SHM_VERSION;
+    area->robots=XBEE_SHM_MAX_ROBOTS;
+    area->ring_size=XBEE_SHM_RING_SIZE;
+    std::atomic_thread_fence(std::memory_order_release);
+    area->magic=XBEE_SHM_MAGIC;
+  }
+  shmConsumerLock()=fd;               // kept open, the lock goes with it
+  return area;
+}
+
+/* @closeShmCommandArea
+ * @brief Unmap area, a consumer also releases the rings for the next one
+ */
+inline void closeShmCommandArea(ShmCommandArea *area)
+{
+  munmap(area,sizeof(ShmCommandArea));
+  if(shmConsumerLock()>=0)
+  {
+    close(shmConsumerLock());
+    shmConsumerLock()=-1;
+  }
+}
+
+/* @pushShmCommand
+ * @brief Publish one command to robot, producer side
+ * @return false if the ring is full (the command is dropped)
+ */
+inline bool pushShmCommand(ShmCommandArea *area,int robot,const ShmCommand &cmd)
+{
+  ShmCommandRing &ring=area->ring[robot];
+  const uint64_t head=ring.head.load(std::memory_order_relaxed);
+  if(head-ring.tail.load(std::memory_order_acquire)>=XBEE_SHM_RING_SIZE)
+  {
+    ring.dropped.store(ring.dropped.load(std::memory_order_relaxed)+1,std::memory_order_relaxed);
+    return false;
+  }
+  ring.slot[head%XBEE_SHM_RING_SIZE]=cmd;
+  ring.head.store(head+1,std::memory_order_release);
+  return true;
+}
+
+/* @peekShmCommand
+ * @brief Copy the oldest command of robot without taking it, consumer side
+ * @return false if the ring is empty
+ */
+inline bool peekShmCommand(ShmCommandArea *area,int robot,ShmCommand *cmd)
+{
+  ShmCommandRing &ring=area->ring[robot];
+  const uint64_t tail=ring.tail.load(std::memory_order_relaxed);
+  if(tail==ring.head.load(std::memory_order_acquire))
+  {
+    return false;
+  }
+  *cmd=ring.slot[tail%XBEE_SHM_RING_SIZE];
+  return true;
+}
+
+/* @popShmCommand
+ * @brief Take the oldest command of robot, consumer side
+ * @return false if the ring is empty
+ */
+inline bool popShmCommand(ShmCommandArea *area,int robot,ShmCommand *cmd)
+{
+  ShmCommandRing &ring=area->ring[robot];
+  const uint64_t tail=ring.tail.load(std::memory_order_relaxed);
+  if(tail==ring.head.load(std::memory_order_acquire))
+  {
+    return false;
+  }
+  *cmd=ring.slot[tail%XBEE_SHM_RING_SIZE];
+  ring.tail.store(tail+1,std::memory_order_release);
+  return true;
+}
+
+#endif // XBEE_SHM_H
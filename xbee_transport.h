@@ -0,0 +1,230 @@
+/**
+ * @file xbee_transport.h
+ *
+ * @brief Serial transport of usbserial-xbee, header only
+ * @detail Opens a tty for the XBee in raw mode, writes whole cycles and
+ *         feeds received bytes to a FrameDecoder of xbee_codec.h. The
+ *         scheduler, links and API mode stay in usbserial-xbee.cpp.
+**/
+#ifndef XBEE_TRANSPORT_H
+#define XBEE_TRANSPORT_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#include <atomic>
+#include "xbee_codec.h"
+
+// syscalls made on the transmit path, shared by every translation unit
+inline std::atomic<unsigned long> &txSyscalls()
+{
+  static std::atomic<unsigned long> count(0);
+  return count;
+}
+
+/* @writeAll
+ * @brief Write whole buffer to fd, retrying on short write, EINTR and EAGAIN
+ * @param[in] timeout_ms Maximum time to wait for the port to become writable
+ * @return 0 on success, -1 on error (errno is set, ETIMEDOUT on timeout)
+ */
+inline int writeAll(int fd,const uint8_t *buf,size_t len,int timeout_ms)
+{
+  struct pollfd pfd;
+  ssize_t ret=0;
+  int ready=0;
+
+  while(len>0)
+  {
+    txSyscalls().fetch_add(1,std::memory_order_relaxed);
+    ret=write(fd,buf,len);
+    if(ret>0)
+    {
+      buf+=ret;
+      len-=ret;
+      continue;
+    }
+    if(ret<0&&errno==EINTR)
+    {
+      continue;
+    }
+    if(ret<0&&errno!=EAGAIN&&errno!=EWOULDBLOCK)
+    {
+      return -1;
+    }
+  // tty buffer is full, wait until it drains
+    pfd.fd=fd;
+    pfd.events=POLLOUT;
+    txSyscalls().fetch_add(1,std::memory_order_relaxed);
+    ready=poll(&pfd,1,timeout_ms);
+    if(ready<0&&errno!=EINTR)
+    {
+      return -1;
+    }
+    if(ready==0)
+    {
+      errno=ETIMEDOUT;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* @readAvailable
+ * @brief Read everything already in the receive queue of a non-blocking fd
+ * @return 0 on success, -1 on error or end of file (errno is set)
+ */
+inline int readAvailable(int fd,FrameDecoder *dec)
+{
+  uint8_t buf[256];
+  ssize_t ret=0;
+
+  while(true)
+  {
+    ret=read(fd,buf,sizeof(buf));
+    if(ret>0)
+    {
+      feedFrameDecoder(dec,buf,ret);
+      continue;
+    }
+    if(ret<0&&errno==EINTR)
+    {
+      continue;
+    }
+    if(ret<0&&(errno==EAGAIN||errno==EWOULDBLOCK))
+    {
+      return 0;
+    }
+    if(ret==0)
+    {
+      errno=EPIPE;    // device was unplugged
+    }
+    return -1;
+  }
+}
+
+/* @baudRateToSpeed
+ * @return termios speed of baud, B0 if not supported
+ */
+inline speed_t baudRateToSpeed(int baud)
+{
+  switch(baud)
+  {
+    case 9600:   return B9600;
+    case 19200:  return B19200;
+    case 38400:  return B38400;
+    case 57600:  return B57600;
+    case 115200: return B115200;
+    case 230400: return B230400;
+    case 460800: return B460800;
+    case 921600: return B921600;
+    default:     return B0;
+  }
+}
+
+/* @setLowLatency
+ * @brief Set ASYNC_LOW_LATENCY so the driver pushes received bytes at once
+ * @detail Ports without TIOCGSERIAL (pty, some USB drivers) are left as is.
+ */
+inline void setLowLatency(int fd,const char *port)
+{
+  struct serial_struct serial;
+  if(ioctl(fd,TIOCGSERIAL,&serial)<0)
+  {
+    return;
+  }
+  serial.flags|=ASYNC_LOW_LATENCY;
+  if(ioctl(fd,TIOCSSERIAL,&serial)<0)
+  {
+    fprintf(stderr,"[%s] %s:%u # %s: can't set low latency: %s\n",__DATE__,__FILE__,__LINE__,port,strerror(errno));
+  }
+}
+
+/* @setLatencyTimer
+ * @brief Shorten the FTDI latency timer through sysfs
+ * @detail The FTDI chip holds received bytes up to 16ms by default before
+ *         sending a USB packet. Only ttyUSB devices of ftdi_sio have the
+ *         file; anything else is left as is. Needs write permission.
+ */
+inline void setLatencyTimer(const char *port,int ms)
+{
+  char device[PATH_MAX],path[PATH_MAX+64];
+  const char *name=NULL;
+  FILE *fp=NULL;
+
+  if(ms<=0||realpath(port,device)==NULL)
+  {
+    return;
+  }
+  name=strrchr(device,'/');
+  name=name!=NULL?name+1:device;
+  snprintf(path,sizeof(path),"/sys/bus/usb-serial/devices/%s/latency_timer",name);
+  fp=fopen(path,"w");
+  if(fp==NULL)
+  {
+    if(errno!=ENOENT)
+    {
+      fprintf(stderr,"[%s] %s:%u # %s: %s\n",__DATE__,__FILE__,__LINE__,path,strerror(errno));
+    }
+    return;
+  }
+  fprintf(fp,"%d\n",ms);
+  fclose(fp);
+}
+
+/* @openSerialPort
+ * @brief Open serial device non-blocking and put it in raw mode
+ * @param[in] latency_timer_ms FTDI latency timer, 0 leaves the driver default
+ * @return fd, -1 on error (errno is set, EINVAL for an unsupported baud)
+ * @detail cfmakeraw() clears input/output processing and line discipline,
+ *         so every byte goes through unchanged (no CR/LF mapping, no
+ *         XON/XOFF, no echo). 8N1 without flow control, modem lines ignored.
+ */
+inline int openSerialPort(const char *port,int baud,int latency_timer_ms)
+{
+  struct termios tio;                   // Serial communication settings
+  speed_t speed=baudRateToSpeed(baud);
+  if(speed==B0)
+  {
+    errno=EINVAL;
+    return -1;
+  }
+
+  int fd=open(port,O_RDWR|O_NOCTTY|O_NONBLOCK);  // open device
+  if(fd<0)
+  {
+    return -1;
+  }
+
+  if(tcgetattr(fd,&tio)<0)
+  {
+    close(fd);
+    return -1;
+  }
+  cfmakeraw(&tio);
+  tio.c_cflag|=CREAD|CLOCAL;
+  tio.c_cflag&=~(CSTOPB|CRTSCTS);
+  tio.c_cc[VMIN]=1;                     // with O_NONBLOCK read() returns EAGAIN when empty,
+  tio.c_cc[VTIME]=0;                    // VMIN=0 would return 0 which looks like hang-up
+  cfsetispeed(&tio,speed);
+  cfsetospeed(&tio,speed);
+  if(tcsetattr(fd,TCSANOW,&tio)<0)
+  {
+    close(fd);
+    return -1;
+  }
+  tcflush(fd,TCIOFLUSH);                // drop bytes queued before the settings
+
+  setLowLatency(fd,port);
+  setLatencyTimer(port,latency_timer_ms);
+  return fd;
+}
+
+#endif // XBEE_TRANSPORT_H